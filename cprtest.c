@@ -0,0 +1,284 @@
+#include "data.h"
+#include "decode.h"
+#include "interactive.h"
+#include <time.h>
+
+struct Modes Modes;
+
+struct aircraft* interactiveReceiveData(struct modesMessage*);
+int cprNLFunction(double);
+
+/* ============================== CPR checks ================================ */
+
+/* Checks of the position decoding against known messages, built with
+ * "make cprtest" and run from bin/. Exits with a non zero status if one
+ * of the checks fails. With --bench the NL lookup is also timed against
+ * the comparison chain it replaced. */
+
+static void hexToBin(const char* hex, unsigned char* msg)
+{
+    int j;
+
+    for (j = 0; hex[j * 2] && hex[j * 2 + 1]; j++) {
+        unsigned int byte;
+
+        sscanf(hex + j * 2, "%2x", &byte);
+        msg[j] = byte;
+    }
+}
+
+/* The NL function as it was before the table lookup: a chain of
+ * comparisons against the zone transition latitudes. Kept as the reference
+ * for cprNLFunction(). */
+static int cprNLChain(double lat)
+{
+    if (lat < 0)
+        lat = -lat; /* Table is simmetric about the equator. */
+    if (lat < 10.47047130)
+        return 59;
+    if (lat < 14.82817437)
+        return 58;
+    if (lat < 18.18626357)
+        return 57;
+    if (lat < 21.02939493)
+        return 56;
+    if (lat < 23.54504487)
+        return 55;
+    if (lat < 25.82924707)
+        return 54;
+    if (lat < 27.93898710)
+        return 53;
+    if (lat < 29.91135686)
+        return 52;
+    if (lat < 31.77209708)
+        return 51;
+    if (lat < 33.53993436)
+        return 50;
+    if (lat < 35.22899598)
+        return 49;
+    if (lat < 36.85025108)
+        return 48;
+    if (lat < 38.41241892)
+        return 47;
+    if (lat < 39.92256684)
+        return 46;
+    if (lat < 41.38651832)
+        return 45;
+    if (lat < 42.80914012)
+        return 44;
+    if (lat < 44.19454951)
+        return 43;
+    if (lat < 45.54626723)
+        return 42;
+    if (lat < 46.86733252)
+        return 41;
+    if (lat < 48.16039128)
+        return 40;
+    if (lat < 49.42776439)
+        return 39;
+    if (lat < 50.67150166)
+        return 38;
+    if (lat < 51.89342469)
+        return 37;
+    if (lat < 53.09516153)
+        return 36;
+    if (lat < 54.27817472)
+        return 35;
+    if (lat < 55.44378444)
+        return 34;
+    if (lat < 56.59318756)
+        return 33;
+    if (lat < 57.72747354)
+        return 32;
+    if (lat < 58.84763776)
+        return 31;
+    if (lat < 59.95459277)
+        return 30;
+    if (lat < 61.04917774)
+        return 29;
+    if (lat < 62.13216659)
+        return 28;
+    if (lat < 63.20427479)
+        return 27;
+    if (lat < 64.26616523)
+        return 26;
+    if (lat < 65.31845310)
+        return 25;
+    if (lat < 66.36171008)
+        return 24;
+    if (lat < 67.39646774)
+        return 23;
+    if (lat < 68.42322022)
+        return 22;
+    if (lat < 69.44242631)
+        return 21;
+    if (lat < 70.45451075)
+        return 20;
+    if (lat < 71.45986473)
+        return 19;
+    if (lat < 72.45884545)
+        return 18;
+    if (lat < 73.45177442)
+        return 17;
+    if (lat < 74.43893416)
+        return 16;
+    if (lat < 75.42056257)
+        return 15;
+    if (lat < 76.39684391)
+        return 14;
+    if (lat < 77.36789461)
+        return 13;
+    if (lat < 78.33374083)
+        return 12;
+    if (lat < 79.29428225)
+        return 11;
+    if (lat < 80.24923213)
+        return 10;
+    if (lat < 81.19801349)
+        return 9;
+    if (lat < 82.13956981)
+        return 8;
+    if (lat < 83.07199445)
+        return 7;
+    if (lat < 83.99173563)
+        return 6;
+    if (lat < 84.89166191)
+        return 5;
+    if (lat < 85.75541621)
+        return 4;
+    if (lat < 86.53536998)
+        return 3;
+    if (lat < 87.00000000)
+        return 2;
+    else
+        return 1;
+}
+
+/* cprNLFunction() must return the same zone count as the chain for every
+ * latitude, including both sides of each transition latitude. */
+static int checkNL(void)
+{
+    static const double edges[] = {
+        0, 10.47047130, 14.82817437, 50.67150166, 86.53536998, 87.0, 90.0
+    };
+    long bad = 0;
+    long i;
+    int j, k;
+
+    for (i = -9100000; i <= 9100000; i++) {
+        double lat = i * 1e-5;
+
+        if (cprNLFunction(lat) != cprNLChain(lat))
+            bad++;
+    }
+    for (j = 0; j < (int)(sizeof(edges) / sizeof(edges[0])); j++) {
+        double v[3];
+
+        v[0] = nextafter(edges[j], -1e9);
+        v[1] = edges[j];
+        v[2] = nextafter(edges[j], 1e9);
+        for (k = 0; k < 3; k++) {
+            if (cprNLFunction(v[k]) != cprNLChain(v[k]))
+                bad++;
+            if (cprNLFunction(-v[k]) != cprNLChain(-v[k]))
+                bad++;
+        }
+    }
+    if (cprNLFunction(NAN) != cprNLChain(NAN))
+        bad++;
+    printf("NL: %ld mismatches\n", bad);
+    return bad == 0;
+}
+
+static double nanoseconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Time the chain and the table on random latitudes. Low latitudes are the
+ * best case of the chain, the whole range is closer to real traffic. */
+static void benchNL(void)
+{
+    static const double ranges[3][2] = { { 0, 30 }, { 50, 70 }, { -90, 90 } };
+    int n = 1 << 16, rounds = 100;
+    double* lat = malloc(n * sizeof(double));
+    volatile long sum = 0;
+    int r, i, j;
+
+    for (r = 0; r < 3; r++) {
+        double t0, t1, t2;
+
+        srand(1);
+        for (i = 0; i < n; i++)
+            lat[i] = ranges[r][0] + (ranges[r][1] - ranges[r][0]) * rand() / RAND_MAX;
+        t0 = nanoseconds();
+        for (j = 0; j < rounds; j++)
+            for (i = 0; i < n; i++)
+                sum += cprNLChain(lat[i]);
+        t1 = nanoseconds();
+        for (j = 0; j < rounds; j++)
+            for (i = 0; i < n; i++)
+                sum += cprNLFunction(lat[i]);
+        t2 = nanoseconds();
+        printf("NL lat %g..%g: chain %.2f ns, table %.2f ns\n",
+            ranges[r][0], ranges[r][1],
+            (t1 - t0) / n / rounds, (t2 - t1) / n / rounds);
+    }
+    free(lat);
+}
+
+/* Decode a single odd airborne position message with the receiver position
+ * as the reference. Message and expected position are the worked example
+ * of "The 1090 MHz Riddle". */
+static int checkLocalOdd(void)
+{
+    struct modesMessage mm;
+    unsigned char msg[MODES_LONG_MSG_BYTES];
+    struct aircraft* a;
+
+    Modes.lat = 52.258;
+    Modes.lon = 3.918;
+    hexToBin("8D40621D58C386435CC412692AD6", msg);
+    memset(&mm, 0, sizeof(mm));
+    mm.ms = mstime();
+    decodeModesMessage(&mm, msg);
+    a = interactiveReceiveData(&mm);
+    if (!a || !mm.crcok || !mm.fflag) {
+        printf("local odd: message not decoded\n");
+        return 0;
+    }
+    printf("local odd: %.5f %.5f\n", a->lat, a->lon);
+    return fabs(a->lat - 52.26578) < 1e-4 && fabs(a->lon - 3.93891) < 1e-4;
+}
+
+int main(int argc, char** argv)
+{
+    int failed = 0;
+
+    Modes.fix_errors = 1;
+    Modes.check_crc = 1;
+    Modes.interactive_ttl = MODES_INTERACTIVE_TTL;
+    Modes.aircraft_pool = MODES_AIRCRAFT_POOL_LEN;
+    Modes.icao_cache_len = MODES_ICAO_CACHE_LEN;
+    Modes.max_range = MODES_MAX_RANGE;
+    modesInitChecksum();
+    modesInitSyndromes();
+    modesInitICAOCache();
+    modesInitAircrafts();
+    modesInitCPR();
+
+    if (!checkNL()) {
+        printf("FAILED: NL table differs from the reference chain\n");
+        failed++;
+    }
+    if (!checkLocalOdd()) {
+        printf("FAILED: local decoding of an odd message\n");
+        failed++;
+    }
+    if (argc > 1 && !strcmp(argv[1], "--bench"))
+        benchNL();
+    return failed ? 1 : 0;
+}
@@ -8,22 +8,27 @@
 #include <math.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 
 #define MODES_DEFAULT_RATE 2000000
+#define MODES_CLOCK_RATE 12000000 /* Message timestamps clock. */
+#define MODES_CLOCK_PER_SAMPLE (MODES_CLOCK_RATE / MODES_DEFAULT_RATE)
 #define MODES_DEFAULT_FREQ 1090000000
 #define MODES_DEFAULT_WIDTH 1000
 #define MODES_DEFAULT_HEIGHT 700
 #define MODES_ASYNC_BUF_NUMBER 12
 #define MODES_DATA_LEN (16 * 16384) /* 256k */
+#define MODES_RING_DEPTH 8 /* IQ blocks queued between reader and decoder. */
 #define MODES_AUTO_GAIN -100 /* Use automatic gain. */
 #define MODES_MAX_GAIN 999999 /* Use max available gain. */
 
@@ -34,7 +39,8 @@
 #define MODES_LONG_MSG_BYTES (112 / 8)
 #define MODES_SHORT_MSG_BYTES (56 / 8)
 
-#define MODES_ICAO_CACHE_LEN 1024 /* Power of two required. */
+#define MODES_ICAO_CACHE_LEN 1024 /* Default number of entries. */
+#define MODES_ICAO_CACHE_WAYS 8 /* Entries per set, a set is 64 bytes. */
 #define MODES_ICAO_CACHE_TTL 60 /* Time to live of cached addresses. */
 #define MODES_UNIT_FEET 0
 #define MODES_UNIT_METERS 1
@@ -52,16 +58,45 @@
 #define MODES_DEBUG_NOPREAMBLE_LEVEL 25
 
 #define MODES_INTERACTIVE_REFRESH_TIME 250 /* Milliseconds */
-#define MODES_INTERACTIVE_ROWS 15 /* Rows on screen */
+#define MODES_INTERACTIVE_ROWS 15 /* Rows when the screen size is unknown */
+#define MODES_INTERACTIVE_HEADER_ROWS 6 /* Rows above the aircrafts. */
 #define MODES_INTERACTIVE_TTL 60 /* TTL before being removed */
+#define MODES_SORT_NONE 0 /* Display list order, last seen first. */
+#define MODES_SORT_DISTANCE 1
+#define MODES_SORT_ALTITUDE 2
+#define MODES_SORT_MESSAGES 3
+#define MODES_CPR_LOCAL_TTL 600 /* Max age of a CPR reference position. */
+#define MODES_MAX_RANGE 300 /* Km, farther positions are discarded. */
+#define MODES_AIRCRAFT_TABLE_LEN 1024 /* Initial size, power of two. */
+#define MODES_AIRCRAFT_POOL_LEN 256 /* Aircraft records per slab. */
+#define MODES_EXPIRY_WHEEL_LEN 64 /* Seconds, power of two. */
 
 #define MODES_NET_MAX_FD 1024
 #define MODES_NET_OUTPUT_SBS_PORT 30003
 #define MODES_NET_OUTPUT_RAW_PORT 30002
 #define MODES_NET_INPUT_RAW_PORT 30001
 #define MODES_NET_HTTP_PORT 8080
+#define MODES_NET_OUTPUT_BEAST_PORT 30005
 #define MODES_CLIENT_BUF_SIZE 1024
 #define MODES_NET_SNDBUF_SIZE (1024 * 64)
+#define MODES_NET_CLIENT_OUTBUF_SIZE (1024 * 256) /* Unsent data per client. */
+#define MODES_NET_EVENTS 64 /* epoll events handled at once. */
+
+#define MODES_NET_SERVICE_SBS 0
+#define MODES_NET_SERVICE_RAW 1
+#define MODES_NET_SERVICE_BEAST 2
+#define MODES_NET_SERVICE_RAW_IN 3
+#define MODES_NET_SERVICE_HTTP 4
+#define MODES_NET_SERVICES 5
+#define MODES_NET_INPUT_BUF_SIZE (1024 * 16) /* Input ring, power of two. */
+#define MODES_HTTP_HEADER_SIZE 256 /* Room for the response header. */
+#define MODES_MERGE_TABLE_LEN 4096 /* Frames remembered, power of two. */
+#define MODES_MERGE_WAYS 4 /* Frames per set of the merge table. */
+#define MODES_MERGE_WINDOW 1000 /* Milliseconds. */
+
+#define MODES_MAX_DEVICES 8 /* RTLSDR devices used at once. */
+#define MODES_RTLTCP_PORT "1234" /* Default rtl_tcp server port. */
+#define MODES_RTLTCP_RCVBUF_SIZE (1024 * 1024) /* About 0.25 s of samples. */
 
 #define MODES_NOTUSED(V) ((void)V)
 
@@ -83,45 +118,225 @@ struct aircraft {
     int even_cprlon;
     double lat, lon; /* Coordinated obtained from CPR encoded data. */
     double distance; /* Distance to Location */
+    long long position_time; /* mstime() of the last position, 0 if none. */
     long long odd_cprtime, even_cprtime;
-    struct aircraft* next; /* Next aircraft in our linked list. */
+    struct aircraft* next; /* Next aircraft in display order. */
+    struct aircraft* prev; /* Previous aircraft in display order. */
+    struct aircraft* expire_next; /* Next aircraft in the expiry bucket. */
+};
+
+/* A TCP service: a listening socket and the clients connected to it.
+ * Output is batched in 'buf' and sent to every client at the next flush. */
+struct netService {
+    const char* descr;
+    int port;
+    int fd; /* Listening socket, -1 if not listening. */
+    char* buf; /* Output waiting for the next flush. */
+    size_t len;
+    int clients; /* Connected clients. */
+};
+
+/* A serialized /data/aircraft.json response. Clients send it straight
+ * from 'buf', so it is only reused for the next snapshot when no client
+ * holds it anymore, otherwise the last one to finish sending frees it. */
+struct httpSnapshot {
+    int refs; /* Modes.http_snapshot and the clients sending it. */
+    char* buf; /* Body after MODES_HTTP_HEADER_SIZE bytes. */
+    size_t size;
+    char* response; /* Header and body, in buf. */
+    size_t len;
+    size_t header_len;
+    char etag[24]; /* Quoted hash of the body. */
+    long long time; /* mstime() of the snapshot. */
+};
+
+/* A client connected to one of the services. 'out' holds the data the
+ * kernel could not accept yet, from 'outpos' to 'outlen'. HTTP clients
+ * send a snapshot from 'snappos' to 'snaplen' without copying it. Input
+ * clients instead receive in the 'in' ring, filled at 'inhead' and parsed
+ * from 'intail', both running counters masked by
+ * MODES_NET_INPUT_BUF_SIZE - 1. */
+struct client {
+    int fd;
+    int service; /* MODES_NET_SERVICE_* */
+    char* out;
+    size_t outpos;
+    size_t outlen;
+    uint32_t events; /* epoll events watched. */
+    struct httpSnapshot* snapshot; /* HTTP: response being sent, or NULL. */
+    size_t snappos;
+    size_t snaplen;
+    unsigned char* in;
+    uint32_t inhead;
+    uint32_t intail;
+    long long messages; /* Input: messages received. */
+    long long duplicates; /* Input: messages already received from others. */
+    int closing; /* HTTP: close once the output is sent. */
+    struct client* next;
+};
+
+/* A frame recently received, to find the copies sent by other sources. */
+struct mergeEntry {
+    unsigned char msg[MODES_LONG_MSG_BYTES];
+    unsigned char len; /* Bytes, 0 for an unused entry. */
+    int source; /* Source of the first copy. */
+    long long ms; /* mstime() of the first copy. */
+};
+
+/* A set of the ICAO address cache: MODES_ICAO_CACHE_WAYS addresses with
+ * the time, in seconds, they were last seen. A zero address is an empty
+ * way. The whole set fits in a single cache line. */
+struct icaoCacheSet {
+    atomic_uint addr[MODES_ICAO_CACHE_WAYS];
+    atomic_uint seen[MODES_ICAO_CACHE_WAYS];
+};
+
+/* A slab of aircraft records. Slabs are never freed, unused records are
+ * kept in the Modes.aircraft_free list. */
+struct aircraftSlab {
+    struct aircraftSlab* next; /* Previously allocated slab. */
+    uint32_t len; /* Number of records. */
+    struct aircraft records[];
+};
+
+/* A block of IQ samples ready to be decoded. 'seam' holds the last
+ * (MODES_FULL_LEN - 1) * 4 bytes of the previous block and 'data' the
+ * 'len' new bytes. When the block was copied in the ring the two are
+ * contiguous in the slot buffer, in zero copy mode 'data' is the buffer
+ * handed out by librtlsdr. */
+struct iqBlock {
+    unsigned char* seam;
+    unsigned char* data;
+    uint32_t len;
+    unsigned char* buf; /* Slot buffer owned by the ring. */
+    uint64_t timestamp; /* 12 MHz clock of the first 'data' sample. */
+    long long ms; /* mstime() of the first 'data' sample. */
+};
+
+/* Single producer / single consumer ring of raw IQ blocks. The reader
+ * thread is the only writer of 'head' and the decoder the only writer of
+ * 'tail'. Both run over [0, 2 * depth) so that a full ring can be told
+ * apart from an empty one for any depth. */
+struct iqRing {
+    struct iqBlock* blocks; /* 'depth' slots. */
+    uint32_t depth; /* Number of slots. */
+    atomic_uint head; /* Next slot to be filled by the reader. */
+    atomic_uint tail; /* Next slot to be consumed by the decoder. */
+    unsigned char* last; /* Tail of the last block, carried to the next. */
+    unsigned char* seam; /* Zero copy mode: copy of the last block tail. */
+    atomic_int waiting; /* Decoder is sleeping on 'cond'. */
+    atomic_int lending; /* Reader is sleeping on 'released'. */
+    atomic_int closed; /* No more blocks will be added. */
+    uint64_t samples; /* Samples received, dropped blocks included. */
+    pthread_mutex_t mutex; /* Only used to sleep on the conditions. */
+    pthread_cond_t cond; /* Signaled when a block is added. */
+    pthread_cond_t released; /* Signaled when a block is released. */
+
+    /* Statistics */
+    atomic_uint high_water; /* Max slots in use at once. */
+    atomic_uint dropped; /* Blocks dropped because the ring was full. */
 };
 
 /* Program global state. */
 struct Modes{
     /* Internal state */
     pthread_t reader_thread;
-    pthread_mutex_t data_mutex; /* Mutex to synchronize buffer access. */
-    pthread_cond_t data_cond; /* Conditional variable associated. */
-    unsigned char* data; /* Raw IQ samples buffer */
+    struct iqRing ring; /* Raw IQ blocks waiting to be decoded. */
     uint16_t* magnitude; /* Magnitude vector */
     uint32_t data_len; /* Buffer length. */
-    int data_ready; /* Data ready to be processed. */
-    uint32_t* icao_cache; /* Recently seen ICAO addresses cache. */
+    struct icaoCacheSet* icao_cache; /* Recently seen ICAO addresses cache. */
+    uint32_t icao_cache_sets; /* Number of sets, power of two. */
     uint16_t* maglut; /* I/Q -> Magnitude lookup table. */
+    uint16_t* maglut_pair; /* Raw 16 bit I/Q pair -> Magnitude table. */
     int exit; /* Exit from the main loop when true. */
 
+    /* Demodulation workers */
+    struct demodChunk* demod_chunks; /* One chunk per thread. */
+    int demod_nchunks; /* Chunks of the current block. */
+    int demod_next; /* Next chunk to be processed. */
+    int demod_pending; /* Chunks not yet processed. */
+    unsigned int demod_generation; /* Incremented for every block. */
+    pthread_mutex_t demod_mutex; /* Protects the fields above. */
+    pthread_cond_t demod_cond; /* Signaled when a new block is split. */
+    pthread_cond_t demod_done; /* Signaled when all chunks are done. */
+
+    /* Networking */
+    int net; /* Enable networking. */
+    int net_output_sbs_port; /* SBS output TCP port. */
+    int net_output_raw_port; /* Raw AVR output TCP port. */
+    int net_output_beast_port; /* Beast binary output TCP port. */
+    int net_input_raw_port; /* Raw AVR / Beast input TCP port. */
+    int net_only; /* No IQ source, only network input. */
+    int net_http_port; /* HTTP server TCP port. */
+    struct httpSnapshot* http_snapshot; /* Last JSON snapshot, or NULL. */
+    struct mergeEntry* merge_table; /* Frames recently received. */
+    int merge_window; /* Milliseconds a frame is remembered. */
+    int epfd; /* epoll instance of all the sockets. */
+    struct netService services[MODES_NET_SERVICES];
+    struct client* clients[MODES_NET_MAX_FD]; /* Clients by file descriptor. */
+    struct client* client_list; /* All the clients. */
+
     /* RTLSDR */
-    int dev_index;
+    struct sdrDevice* devices; /* Receivers, 'ndevices' of them. */
+    int ndevices; /* 0 when reading a file or only the network. */
+    char* device_names[MODES_MAX_DEVICES]; /* Device index or serial. */
+    pthread_mutex_t tracker_mutex; /* Several devices: serializes the
+                                    * decoders past demodulation. */
     int gain;
-    rtlsdr_dev_t* dev;
     int freq;
 
+    /* File input */
+    char* filename; /* Raw 8 bit unsigned IQ capture, or NULL. */
+    unsigned char* file_data; /* Memory mapped file contents. */
+    size_t file_len; /* Length of the mapping. */
+    int realtime; /* Pace the file at the device sample rate. */
+
+    /* rtl_tcp input */
+    char* rtltcp; /* Server as host[:port], or NULL. */
+    int rtltcp_fd;
+
     /* Configuration */
     int fix_errors; /* Single bit error correction if true. */
     int check_crc; /* Only display messages with good CRC. */
     int debug; /* Debugging mode. */
     int interactive; /* Interactive mode */
-    int interactive_rows; /* Interactive mode: max number of rows. */
+    int interactive_rows; /* Interactive mode: rows if not a terminal. */
+    int interactive_sort; /* Interactive mode: MODES_SORT_* order. */
     int interactive_ttl; /* Interactive mode: TTL before deletion. */
     int metric; /* Use metric units. */
     int aggressive; /* Aggressive detection algorithm. */
+    int ring_depth; /* Number of IQ blocks in the ring. */
+    int zero_copy; /* Decode in place from the librtlsdr buffers. */
+    char* magnitude_kernel; /* Magnitude kernel name, NULL for auto. */
+    char* preamble_kernel; /* Preamble prefilter name, NULL for auto. */
+    int demod_threads; /* Threads demodulating every block. */
+    int aircraft_pool; /* Aircraft records allocated per slab. */
+    int aircraft_max; /* Max aircraft records, 0 for no limit. */
+    int icao_cache_len; /* Entries of the ICAO address cache. */
 
     /* Interactive mode */
-    struct aircraft* aircrafts;
+    struct aircraft* aircrafts; /* Aircrafts in display order. */
+    struct aircraft** aircraft_table; /* Aircrafts by ICAO address. */
+    uint32_t aircraft_table_len; /* Slots, power of two. */
+    uint32_t aircraft_count; /* Aircrafts in the table. */
+    struct aircraftSlab* aircraft_slabs; /* Memory of the aircraft records. */
+    struct aircraft* aircraft_free; /* Unused records, linked by 'next'. */
+    uint32_t aircraft_records; /* Records in all the slabs. */
+    struct aircraft* expiry_wheel[MODES_EXPIRY_WHEEL_LEN]; /* By second. */
+    time_t expiry_last; /* Last second checked for stale aircrafts. */
     long long interactive_last_update; /* Last screen update in milliseconds */
+    char* screen; /* Characters on screen, screen_rows * screen_cols. */
+    char* screen_frame; /* Frame being formatted, same layout. */
+    int screen_rows;
+    int screen_cols;
+    char* screen_out; /* Terminal output of the frame. */
+    size_t screen_out_len;
+    size_t screen_out_size;
+    struct aircraft** screen_sorted; /* Aircrafts in --sort order. */
+    uint32_t screen_sorted_len; /* Allocated entries. */
     double lat;
     double lon;
+    double max_range; /* Km from lat / lon, farther positions are wrong. */
 
     /* Statistics */
     long long stat_valid_preamble;
@@ -132,8 +347,24 @@ struct Modes{
     long long stat_single_bit_fix;
     long long stat_two_bits_fix;
     long long stat_http_requests;
-    long long stat_sbs_connections;
+    long long stat_http_not_modified; /* Requests answered with 304. */
+    long long stat_http_snapshots; /* JSON snapshots serialized. */
+    long long stat_sbs_connections; /* SBS clients connected. */
+    long long stat_net_slow_clients; /* Clients dropped for not reading. */
+    long long stat_net_input; /* Messages received from the network. */
+    long long stat_net_input_errors; /* Bytes skipped resyncing the input. */
+    long long stat_merge_duplicates; /* Copies of the same frame dropped. */
     long long stat_out_of_phase;
+    long long stat_samples; /* IQ samples processed. */
+    long long stat_rtltcp_reads; /* recv() calls returning samples. */
+    atomic_llong stat_icao_hits; /* Cache lookups finding the address. */
+    atomic_llong stat_icao_misses; /* Cache lookups not finding it. */
+    atomic_llong stat_icao_evictions; /* Live entries replaced. */
+    atomic_llong stat_icao_collisions; /* Adds to a set holding other live
+                                        * addresses. */
+    long long stat_aircraft_live; /* Aircraft records in use. */
+    long long stat_aircraft_peak; /* Max aircraft records in use at once. */
+    long long stat_aircraft_failed; /* Aircraft allocations failed: pool exhausted. */
 };
 
 /* The struct we use to store information about a decoded message. */
@@ -147,6 +378,12 @@ struct modesMessage {
     int errorbit; /* Bit corrected. -1 if no bit corrected. */
     int aa1, aa2, aa3; /* ICAO Address bytes 1 2 and 3 */
     int phase_corrected; /* True if phase correction was applied. */
+    uint32_t offset; /* Sample offset of the preamble in the block. */
+    uint64_t timestamp; /* 12 MHz clock at the start of the preamble. */
+    unsigned char signal; /* Mean magnitude of the message bits, 0-255. */
+    long long ms; /* mstime() at the start of the preamble. */
+    int source; /* Minus the device number for local receivers, else
+                 * input client fd + 1. */
 
     /* DF 11 */
     int ca; /* Responder capabilities. */
@@ -181,4 +418,47 @@ struct modesMessage {
     int altitude, unit;
 };
 
+/* A message found while demodulating a chunk, waiting to be merged. */
+struct demodMessage {
+    struct modesMessage mm;
+    int errors; /* Bits that could not be demodulated. */
+    int use_correction; /* Found with phase correction. */
+};
+
+/* Part of the magnitude buffer demodulated by a single thread. */
+struct demodChunk {
+    uint16_t* m; /* First sample of the chunk. */
+    uint32_t mlen; /* Samples, including the overlap with the next chunk. */
+    uint32_t offset; /* Offset of 'm' in the magnitude buffer. */
+    uint64_t timestamp; /* 12 MHz clock of the magnitude buffer start. */
+    long long ms; /* mstime() of the magnitude buffer start. */
+    int source; /* Source of the messages, see struct modesMessage. */
+    struct demodMessage* msgs; /* Messages found, in sample order. */
+    int nmsgs;
+    int maxmsgs;
+
+    /* Statistics */
+    long long stat_valid_preamble;
+    long long stat_out_of_phase;
+};
+
+/* An RTLSDR device with its reader thread. Device 0 uses Modes.ring and
+ * Modes.magnitude, and is decoded by the main thread and the worker pool
+ * when it is the only one. With several devices, each one has its own
+ * ring and demodulator thread, and they feed the tracker in turn. */
+struct sdrDevice {
+    int index; /* librtlsdr device index. */
+    rtlsdr_dev_t* dev;
+    pthread_t reader_thread;
+    pthread_t demod_thread;
+    struct iqRing* ring;
+    uint16_t* magnitude;
+    struct demodChunk chunk; /* The whole block, for detectModeSAlone(). */
+
+    /* Statistics */
+    long long stat_samples; /* IQ samples processed. */
+    long long stat_goodcrc; /* Messages with good CRC. */
+    long long stat_duplicates; /* Messages also received by another device. */
+};
+
 #endif //DATA_H
\ No newline at end of file
@@ -1,9 +1,11 @@
 #include "decode.h"
 #include "data.h"
+#include "merge.h"
+#include "net.h"
+#include "preamble.h"
 
 extern struct Modes Modes;
 
-void useModesMessage(struct modesMessage*);
 struct aircraft* interactiveReceiveData(struct modesMessage*);
 
 /* ===================== Mode S detection and decoding  ===================== */
@@ -43,21 +45,38 @@ uint32_t modes_checksum_table[112] = {
     0x000000, 0x000000, 0x000000, 0x000000, 0x000000, 0x000000, 0x000000, 0x000000
 };
 
+/* The parity table is the bit by bit form of the CRC-24 with generator
+ * polynomial 0x1FFF409, computed over the message without its last 24 bits.
+ * The same CRC can be computed a byte at a time: modes_crc_table[b] is the
+ * remainder of the division of b * x^24 by the generator, so the CRC of a
+ * message is updated for every byte with a single lookup.
+ *
+ * Populated by modesInitChecksum(). */
+uint32_t modes_crc_table[256];
+
+void modesInitChecksum(void)
+{
+    uint32_t j, k;
+
+    for (j = 0; j < 256; j++) {
+        uint32_t crc = j << 16;
+
+        for (k = 0; k < 8; k++)
+            crc = (crc & 0x800000) ? (crc << 1) ^ 0xfff409 : crc << 1;
+        modes_crc_table[j] = crc & 0xffffff;
+    }
+}
+
+/* Return the checksum of a message of 'bits' bits. This gives the same
+ * result of xoring the entries of modes_checksum_table for every bit set. */
 uint32_t modesChecksum(unsigned char* msg, int bits)
 {
     uint32_t crc = 0;
-    int offset = (bits == 112) ? 0 : (112 - 56);
     int j;
 
-    for (j = 0; j < bits; j++) {
-        int byte = j / 8;
-        int bit = j % 8;
-        int bitmask = 1 << (7 - bit);
-
-        /* If bit is set, xor with corresponding table entry. */
-        if (msg[byte] & bitmask)
-            crc ^= modes_checksum_table[j + offset];
-    }
+    /* The last three bytes are the transmitted checksum itself. */
+    for (j = 0; j < bits / 8 - 3; j++)
+        crc = ((crc << 8) ^ modes_crc_table[((crc >> 16) ^ msg[j]) & 0xff]) & 0xffffff;
     return crc; /* 24 bit checksum. */
 }
 
@@ -71,109 +90,248 @@ int modesMessageLenByType(int type)
         return MODES_SHORT_MSG_BITS;
 }
 
-/* Try to fix single bit errors using the checksum. On success modifies
- * the original buffer with the fixed version, and returns the position
- * of the error bit. Otherwise if fixing failed -1 is returned. */
-int fixSingleBitErrors(unsigned char* msg, int bits)
+/* Error correction uses the syndrome of the message, that is the xor of the
+ * transmitted CRC and the one computed from the message. Since the CRC is
+ * linear, flipping a bit in the message xors the syndrome with a fixed
+ * value: the bit's entry of modes_checksum_table, or for bits in the CRC
+ * field itself the corresponding bit of the CRC. So the syndrome alone
+ * tells which one or two bits are wrong, and a table mapping every possible
+ * syndrome to the bits to flip makes correction a single CRC computation
+ * plus a lookup.
+ *
+ * There is one table for each message length, indexed by open addressing
+ * on the syndrome. Entries hold the value returned by fixBitErrors(), a
+ * syndrome of zero marks an empty entry. */
+struct syndromeEntry {
+    uint32_t syndrome;
+    int errorbit;
+};
+
+struct syndromeTable {
+    struct syndromeEntry* entries;
+    uint32_t mask; /* Number of entries - 1, power of two. */
+};
+
+struct syndromeTable modes_syndrome_short, modes_syndrome_long;
+
+/* Return the syndrome of the error in bit 'j' of a 'bits' bits message. */
+static uint32_t syndromeOfBit(int j, int bits)
 {
-    int j;
-    unsigned char aux[MODES_LONG_MSG_BITS / 8];
+    if (j < bits - 24)
+        return modes_checksum_table[j + MODES_LONG_MSG_BITS - bits];
+    return 1 << (bits - 1 - j);
+}
 
-    for (j = 0; j < bits; j++) {
-        int byte = j / 8;
-        int bitmask = 1 << (7 - (j % 8));
-        uint32_t crc1, crc2;
-
-        memcpy(aux, msg, bits / 8);
-        aux[byte] ^= bitmask; /* Flip j-th bit. */
-
-        crc1 = ((uint32_t)aux[(bits / 8) - 3] << 16) | ((uint32_t)aux[(bits / 8) - 2] << 8) | (uint32_t)aux[(bits / 8) - 1];
-        crc2 = modesChecksum(aux, bits);
-
-        if (crc1 == crc2) {
-            /* The error is fixed. Overwrite the original buffer with
-             * the corrected sequence, and returns the error bit
-             * position. */
-            memcpy(msg, aux, bits / 8);
-            return j;
-        }
+static uint32_t syndromeHash(uint32_t syndrome)
+{
+    return syndrome * 0x9e3779b1;
+}
+
+/* Add an entry unless the syndrome is already there. Errors are added in
+ * the order a brute force search would try them, one bit errors first,
+ * so on collision the first matching error wins. */
+static void syndromeAdd(struct syndromeTable* t, uint32_t syndrome, int errorbit)
+{
+    uint32_t h = syndromeHash(syndrome) & t->mask;
+
+    while (t->entries[h].syndrome) {
+        if (t->entries[h].syndrome == syndrome)
+            return;
+        h = (h + 1) & t->mask;
+    }
+    t->entries[h].syndrome = syndrome;
+    t->entries[h].errorbit = errorbit;
+}
+
+/* Return the error bits for the syndrome, or -1 if no one or two bit error
+ * has this syndrome. */
+static int syndromeLookup(struct syndromeTable* t, uint32_t syndrome)
+{
+    uint32_t h = syndromeHash(syndrome) & t->mask;
+
+    while (t->entries[h].syndrome) {
+        if (t->entries[h].syndrome == syndrome)
+            return t->entries[h].errorbit;
+        h = (h + 1) & t->mask;
     }
     return -1;
 }
 
-/* Similar to fixSingleBitErrors() but try every possible two bit combination.
- * This is very slow and should be tried only against DF17 messages that
- * don't pass the checksum, and only in Aggressive Mode. */
-int fixTwoBitsErrors(unsigned char* msg, int bits)
+/* Build the table of all the one and two bit errors of 'bits' bits
+ * messages. Returns the memory used. */
+static size_t syndromeBuild(struct syndromeTable* t, int bits)
 {
+    int errors = bits + bits * (bits - 1) / 2;
+    uint32_t size = 1;
     int j, i;
-    unsigned char aux[MODES_LONG_MSG_BITS / 8];
 
+    /* Keep the load factor under 50%. */
+    while (size < (uint32_t)errors * 2)
+        size *= 2;
+    t->mask = size - 1;
+    if ((t->entries = calloc(size, sizeof(struct syndromeEntry))) == NULL) {
+        fprintf(stderr, "Out of memory allocating syndrome table.\n");
+        exit(1);
+    }
+    for (j = 0; j < bits; j++)
+        syndromeAdd(t, syndromeOfBit(j, bits), j);
     for (j = 0; j < bits; j++) {
-        int byte1 = j / 8;
-        int bitmask1 = 1 << (7 - (j % 8));
-
-        /* Don't check the same pairs multiple times, so i starts from j+1 */
-        for (i = j + 1; i < bits; i++) {
-            int byte2 = i / 8;
-            int bitmask2 = 1 << (7 - (i % 8));
-            uint32_t crc1, crc2;
-
-            memcpy(aux, msg, bits / 8);
-
-            aux[byte1] ^= bitmask1; /* Flip j-th bit. */
-            aux[byte2] ^= bitmask2; /* Flip i-th bit. */
-
-            crc1 = ((uint32_t)aux[(bits / 8) - 3] << 16) | ((uint32_t)aux[(bits / 8) - 2] << 8) | (uint32_t)aux[(bits / 8) - 1];
-            crc2 = modesChecksum(aux, bits);
-
-            if (crc1 == crc2) {
-                /* The error is fixed. Overwrite the original buffer with
-                 * the corrected sequence, and returns the error bit
-                 * position. */
-                memcpy(msg, aux, bits / 8);
-                /* We return the two bits as a 16 bit integer by shifting
-                 * 'i' on the left. This is possible since 'i' will always
-                 * be non-zero because i starts from j+1. */
-                return j | (i << 8);
-            }
-        }
+        for (i = j + 1; i < bits; i++)
+            syndromeAdd(t, syndromeOfBit(j, bits) ^ syndromeOfBit(i, bits), j | (i << 8));
     }
-    return -1;
+    return size * sizeof(struct syndromeEntry);
 }
 
-/* Hash the ICAO address to index our cache of MODES_ICAO_CACHE_LEN
- * elements, that is assumed to be a power of two. */
-uint32_t ICAOCacheHashAddress(uint32_t a)
+void modesInitSyndromes(void)
+{
+    struct timespec start, end;
+    size_t size;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size = syndromeBuild(&modes_syndrome_short, MODES_SHORT_MSG_BITS);
+    size += syndromeBuild(&modes_syndrome_long, MODES_LONG_MSG_BITS);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "Syndrome tables: %zu bytes, built in %.3f ms.\n", size,
+        (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+/* Try to fix one bit errors, or up to two bit errors if 'maxerrors' is 2,
+ * using the checksum. On success modifies the original buffer with the
+ * fixed version, and returns the position of the error bit. For two bit
+ * errors the two positions are returned as a 16 bit integer by shifting
+ * the second one on the left, which is always non-zero as it is greater
+ * than the first one. Otherwise if fixing failed -1 is returned. */
+int fixBitErrors(unsigned char* msg, int bits, int maxerrors)
+{
+    uint32_t crc = ((uint32_t)msg[(bits / 8) - 3] << 16) | ((uint32_t)msg[(bits / 8) - 2] << 8) | (uint32_t)msg[(bits / 8) - 1];
+    uint32_t syndrome = crc ^ modesChecksum(msg, bits);
+    int e, j, i;
+
+    if (!syndrome)
+        return -1;
+    e = syndromeLookup(bits == MODES_LONG_MSG_BITS ? &modes_syndrome_long : &modes_syndrome_short, syndrome);
+    if (e == -1 || (e >= 256 && maxerrors < 2))
+        return -1;
+
+    j = e & 0xff;
+    i = e >> 8;
+    msg[j / 8] ^= 1 << (7 - (j % 8)); /* Flip j-th bit. */
+    if (i)
+        msg[i / 8] ^= 1 << (7 - (i % 8)); /* Flip i-th bit. */
+    return e;
+}
+
+/* Hash the ICAO address. The caller masks the result to the size of its
+ * table, that is assumed to be a power of two. */
+uint32_t ICAOHashAddress(uint32_t a)
 {
     /* The following three rounds wil make sure that every bit affects
      * every output bit with ~ 50% of probability. */
     a = ((a >> 16) ^ a) * 0x45d9f3b;
     a = ((a >> 16) ^ a) * 0x45d9f3b;
     a = ((a >> 16) ^ a);
-    return a & (MODES_ICAO_CACHE_LEN - 1);
+    return a;
+}
+
+/* The cache of recently seen ICAO addresses is set associative: an
+ * address can be stored in any of the MODES_ICAO_CACHE_WAYS ways of the set
+ * selected by its hash, so that a few aircrafts colliding on the same set
+ * don't evict each other. When the set is full the least recently seen
+ * address is replaced. Threads demodulating in parallel access the cache
+ * without locking: a lost update only costs a missed message. */
+
+/* Allocate the cache with --icao-cache entries, rounded to a power of two
+ * number of sets. */
+void modesInitICAOCache(void)
+{
+    uint32_t sets = 1;
+
+    while (sets * MODES_ICAO_CACHE_WAYS < (uint32_t)Modes.icao_cache_len)
+        sets <<= 1;
+    Modes.icao_cache_sets = sets;
+    Modes.icao_cache = aligned_alloc(64, sizeof(struct icaoCacheSet) * sets);
+    if (!Modes.icao_cache) {
+        fprintf(stderr, "Out of memory allocating the ICAO address cache.\n");
+        exit(1);
+    }
+    memset(Modes.icao_cache, 0, sizeof(struct icaoCacheSet) * sets);
+    atomic_init(&Modes.stat_icao_hits, 0);
+    atomic_init(&Modes.stat_icao_misses, 0);
+    atomic_init(&Modes.stat_icao_evictions, 0);
+    atomic_init(&Modes.stat_icao_collisions, 0);
+}
+
+/* Return the cache set of the ICAO address. */
+static struct icaoCacheSet* ICAOCacheSet(uint32_t a)
+{
+    return &Modes.icao_cache[ICAOHashAddress(a) & (Modes.icao_cache_sets - 1)];
 }
 
 /* Add the specified entry to the cache of recently seen ICAO addresses.
- * Note that we also add a timestamp so that we can make sure that the
- * entry is only valid for MODES_ICAO_CACHE_TTL seconds. */
-void addRecentlySeenICAOAddr(uint32_t addr)
+ * Note that we also add a timestamp, the reception time of the message in
+ * seconds, so that we can make sure that the entry is only valid for
+ * MODES_ICAO_CACHE_TTL seconds. */
+void addRecentlySeenICAOAddr(uint32_t addr, uint32_t now)
 {
-    uint32_t h = ICAOCacheHashAddress(addr);
-    Modes.icao_cache[h * 2] = addr;
-    Modes.icao_cache[h * 2 + 1] = (uint32_t)time(NULL);
+    struct icaoCacheSet* set = ICAOCacheSet(addr);
+    int32_t oldest = -1;
+    int victim = 0;
+    int live = 0;
+    int j;
+
+    for (j = 0; j < MODES_ICAO_CACHE_WAYS; j++) {
+        uint32_t a = atomic_load_explicit(&set->addr[j], memory_order_relaxed);
+        int32_t age;
+
+        if (a == addr) {
+            atomic_store_explicit(&set->seen[j], now, memory_order_relaxed);
+            return;
+        }
+        if (!a) {
+            age = INT32_MAX; /* Free ways are used first. */
+        } else {
+            age = now - atomic_load_explicit(&set->seen[j], memory_order_relaxed);
+            if (age <= MODES_ICAO_CACHE_TTL)
+                live++;
+            else
+                age = INT32_MAX - 1; /* Then expired entries. */
+        }
+        if (age > oldest) {
+            oldest = age;
+            victim = j;
+        }
+    }
+    if (live)
+        atomic_fetch_add_explicit(&Modes.stat_icao_collisions, 1, memory_order_relaxed);
+    if (oldest <= MODES_ICAO_CACHE_TTL)
+        atomic_fetch_add_explicit(&Modes.stat_icao_evictions, 1, memory_order_relaxed);
+    atomic_store_explicit(&set->addr[victim], addr, memory_order_relaxed);
+    atomic_store_explicit(&set->seen[victim], now, memory_order_relaxed);
 }
 
 /* Returns 1 if the specified ICAO address was seen in a DF format with
  * proper checksum (not xored with address) no more than * MODES_ICAO_CACHE_TTL
  * seconds ago. Otherwise returns 0. */
-int ICAOAddressWasRecentlySeen(uint32_t addr)
+int ICAOAddressWasRecentlySeen(uint32_t addr, uint32_t now)
 {
-    uint32_t h = ICAOCacheHashAddress(addr);
-    uint32_t a = Modes.icao_cache[h * 2];
-    uint32_t t = Modes.icao_cache[h * 2 + 1];
+    struct icaoCacheSet* set = ICAOCacheSet(addr);
+    int j;
 
-    return a && a == addr && time(NULL) - t <= MODES_ICAO_CACHE_TTL;
+    for (j = 0; j < MODES_ICAO_CACHE_WAYS; j++) {
+        if (atomic_load_explicit(&set->addr[j], memory_order_relaxed) == addr) {
+            uint32_t t = atomic_load_explicit(&set->seen[j], memory_order_relaxed);
+
+            /* With several demodulation threads the entry may have been
+             * added by a message received slightly after this one. */
+            if (addr && (int32_t)(now - t) <= MODES_ICAO_CACHE_TTL) {
+                atomic_fetch_add_explicit(&Modes.stat_icao_hits, 1, memory_order_relaxed);
+                return 1;
+            }
+            break;
+        }
+    }
+    atomic_fetch_add_explicit(&Modes.stat_icao_misses, 1, memory_order_relaxed);
+    return 0;
 }
 
 /* If the message type has the checksum xored with the ICAO address, try to
@@ -224,7 +382,7 @@ int bruteForceAP(unsigned char* msg, struct modesMessage* mm)
         /* If the obtained address exists in our cache we consider
          * the message valid. */
         addr = aux[lastbyte] | (aux[lastbyte - 1] << 8) | (aux[lastbyte - 2] << 16);
-        if (ICAOAddressWasRecentlySeen(addr)) {
+        if (ICAOAddressWasRecentlySeen(addr, mm->ms / 1000)) {
             mm->aa1 = aux[lastbyte - 2];
             mm->aa2 = aux[lastbyte - 1];
             mm->aa3 = aux[lastbyte];
@@ -327,16 +485,14 @@ void decodeModesMessage(struct modesMessage* mm, unsigned char* msg)
     mm->crc = ((uint32_t)msg[(mm->msgbits / 8) - 3] << 16) | ((uint32_t)msg[(mm->msgbits / 8) - 2] << 8) | (uint32_t)msg[(mm->msgbits / 8) - 1];
     crc2 = modesChecksum(msg, mm->msgbits);
 
-    /* Check CRC and fix single bit errors using the CRC when
+    /* Check CRC and fix one or two bit errors using the CRC when
      * possible (DF 11 and 17). */
     mm->errorbit = -1; /* No error */
     mm->crcok = (mm->crc == crc2);
 
     if (!mm->crcok && Modes.fix_errors && (mm->msgtype == 11 || mm->msgtype == 17)) {
-        if ((mm->errorbit = fixSingleBitErrors(msg, mm->msgbits)) != -1) {
-            mm->crc = modesChecksum(msg, mm->msgbits);
-            mm->crcok = 1;
-        } else if (Modes.aggressive && mm->msgtype == 17 && (mm->errorbit = fixTwoBitsErrors(msg, mm->msgbits)) != -1) {
+        /* Two bit errors are only fixed in aggressive mode. */
+        if ((mm->errorbit = fixBitErrors(msg, mm->msgbits, Modes.aggressive ? 2 : 1)) != -1) {
             mm->crc = modesChecksum(msg, mm->msgbits);
             mm->crcok = 1;
         }
@@ -403,7 +559,7 @@ void decodeModesMessage(struct modesMessage* mm, unsigned char* msg)
          * addresses. */
         if (mm->crcok && mm->errorbit == -1) {
             uint32_t addr = (mm->aa1 << 16) | (mm->aa2 << 8) | mm->aa3;
-            addRecentlySeenICAOAddr(addr);
+            addRecentlySeenICAOAddr(addr, mm->ms / 1000);
         }
     }
 
@@ -476,28 +632,6 @@ void decodeModesMessage(struct modesMessage* mm, unsigned char* msg)
     mm->phase_corrected = 0; /* Set to 1 by the caller if needed. */
 }
 
-/* Turn I/Q samples pointed by Modes.data into the magnitude vector
- * pointed by Modes.magnitude. */
-void computeMagnitudeVector(void)
-{
-    uint16_t* m = Modes.magnitude;
-    unsigned char* p = Modes.data;
-    uint32_t j;
-
-    /* Compute the magnitudo vector. It's just SQRT(I^2 + Q^2), but
-     * we rescale to the 0-255 range to exploit the full resolution. */
-    for (j = 0; j < Modes.data_len; j += 2) {
-        int i = p[j] - 127;
-        int q = p[j + 1] - 127;
-
-        if (i < 0)
-            i = -i;
-        if (q < 0)
-            q = -q;
-        m[j / 2] = Modes.maglut[i * 129 + q];
-    }
-}
-
 /* Return -1 if the message is out of fase left-side
  * Return  1 if the message is out of fase right-size
  * Return  0 if the message is not particularly out of phase.
@@ -561,15 +695,56 @@ void applyPhaseCorrection(uint16_t* m)
     }
 }
 
-/* Detect a Mode S messages inside the magnitude buffer pointed by 'm' and of
- * size 'mlen' bytes. Every detected Mode S message is convert it into a
- * stream of bits and passed to the function to display it. */
-void detectModeS(uint16_t* m, uint32_t mlen)
+/* Return the prefilter mask for the offsets starting at 'batch', with the
+ * offsets from 'limit' on cleared. */
+static uint32_t preambleBatch(uint16_t* m, uint32_t batch, uint32_t limit)
+{
+    uint32_t mask = preambleCandidates(m + batch);
+
+    if (limit - batch < MODES_PREAMBLE_BATCH)
+        mask &= (1U << (limit - batch)) - 1;
+    return mask;
+}
+
+/* Append a message to the ones found in the chunk. */
+static void demodCollect(struct demodChunk* c, struct modesMessage* mm, int errors, int use_correction)
+{
+    struct demodMessage* dm;
+
+    if (c->nmsgs == c->maxmsgs) {
+        c->maxmsgs = c->maxmsgs ? c->maxmsgs * 2 : 64;
+        if ((c->msgs = realloc(c->msgs, sizeof(struct demodMessage) * c->maxmsgs)) == NULL) {
+            fprintf(stderr, "Out of memory collecting messages.\n");
+            exit(1);
+        }
+    }
+    dm = &c->msgs[c->nmsgs++];
+    dm->mm = *mm;
+    dm->errors = errors;
+    dm->use_correction = use_correction;
+}
+
+/* Detect Mode S messages inside the part of the magnitude buffer described
+ * by 'c'. Every detected Mode S message is converted into a stream of bits,
+ * decoded, and collected in the chunk: messages are only passed to the
+ * next layer by demodUseChunks(), in sample order, so that chunks can be
+ * processed by different threads.
+ *
+ * Note that the magnitude buffer is never modified, as the overlap at the
+ * end of a chunk is the start of the next one. */
+static void detectModeSChunk(struct demodChunk* c)
 {
     unsigned char bits[MODES_LONG_MSG_BITS];
     unsigned char msg[MODES_LONG_MSG_BITS / 2];
-    uint16_t aux[MODES_LONG_MSG_BITS * 2];
+    /* Copy of the message, from one sample before the preamble, where
+     * phase correction is applied. */
+    uint16_t aux[MODES_FULL_LEN * 2 + 1];
+    uint16_t* m = c->m;
+    uint16_t* p; /* Samples of the message being demodulated. */
     uint32_t j;
+    uint32_t limit = c->mlen - MODES_FULL_LEN * 2;
+    uint32_t batch = 0; /* First offset tested by the prefilter. */
+    uint32_t candidates = preambleBatch(m, 0, limit);
     int use_correction = 0;
 
     /* The Mode S preamble is made of impulses of 0.5 microseconds at
@@ -595,13 +770,33 @@ void detectModeS(uint16_t* m, uint32_t mlen)
      * 8   --
      * 9   -------------------
      */
-    for (j = 0; j < mlen - MODES_FULL_LEN * 2; j++) {
+    for (j = 0; j < limit; j++) {
         int low, high, delta, i, errors;
         int good_message = 0;
+        uint32_t rest;
 
         if (use_correction)
             goto good_preamble; /* We already checked it. */
 
+        /* Jump to the next offset that passed the prefilter, testing new
+         * batches of offsets as needed. */
+        if (j >= batch + MODES_PREAMBLE_BATCH) {
+            batch = j;
+            candidates = preambleBatch(m, batch, limit);
+        }
+        rest = candidates >> (j - batch);
+        while (!rest) {
+            batch += MODES_PREAMBLE_BATCH;
+            if (batch >= limit)
+                break;
+            candidates = preambleBatch(m, batch, limit);
+            rest = candidates;
+            j = batch;
+        }
+        if (!rest)
+            break;
+        j += __builtin_ctz(rest);
+
         /* First check of relations between the first 10 samples
          * representing a valid preamble. We don't even investigate further
          * if this simple test is not passed. */
@@ -624,16 +819,20 @@ void detectModeS(uint16_t* m, uint32_t mlen)
         if (m[j + 11] >= high || m[j + 12] >= high || m[j + 13] >= high || m[j + 14] >= high) {
             continue;
         }
-        Modes.stat_valid_preamble++;
+        c->stat_valid_preamble++;
 
     good_preamble:
         /* If the previous attempt with this message failed, retry using
-         * magnitude correction. */
+         * magnitude correction, on a copy of the message. */
+        p = m + j;
         if (use_correction) {
-            memcpy(aux, m + j + MODES_PREAMBLE_US * 2, sizeof(aux));
-            if (j && detectOutOfPhase(m + j)) {
-                applyPhaseCorrection(m + j);
-                Modes.stat_out_of_phase++;
+            /* There is no sample before the start of the block. */
+            aux[0] = (c->offset + j) ? m[j - 1] : 0;
+            memcpy(aux + 1, m + j, MODES_FULL_LEN * 2 * sizeof(uint16_t));
+            p = aux + 1;
+            if ((c->offset + j) && detectOutOfPhase(p)) {
+                applyPhaseCorrection(p);
+                c->stat_out_of_phase++;
             }
             /* TODO ... apply other kind of corrections. */
         }
@@ -642,8 +841,8 @@ void detectModeS(uint16_t* m, uint32_t mlen)
          * size. We'll check the actual message type later. */
         errors = 0;
         for (i = 0; i < MODES_LONG_MSG_BITS * 2; i += 2) {
-            low = m[j + i + MODES_PREAMBLE_US * 2];
-            high = m[j + i + MODES_PREAMBLE_US * 2 + 1];
+            low = p[i + MODES_PREAMBLE_US * 2];
+            high = p[i + MODES_PREAMBLE_US * 2 + 1];
             delta = low - high;
             if (delta < 0)
                 delta = -delta;
@@ -665,10 +864,6 @@ void detectModeS(uint16_t* m, uint32_t mlen)
             }
         }
 
-        /* Restore the original message if we used magnitude correction. */
-        if (use_correction)
-            memcpy(m + j + MODES_PREAMBLE_US * 2, aux, sizeof(aux));
-
         /* Pack bits into bytes */
         for (i = 0; i < MODES_LONG_MSG_BITS; i += 8) {
             msg[i / 8] = bits[i] << 7 | bits[i + 1] << 6 | bits[i + 2] << 5 | bits[i + 3] << 4 | bits[i + 4] << 3 | bits[i + 5] << 2 | bits[i + 6] << 1 | bits[i + 7];
@@ -698,28 +893,25 @@ void detectModeS(uint16_t* m, uint32_t mlen)
          * and CRC may not be correct. This is handled by the next layer. */
         if (errors == 0 || (Modes.aggressive && errors < 3)) {
             struct modesMessage mm;
-
-            /* Decode the received message and update statistics */
+            uint32_t level = 0;
+
+            /* Decode the received message. The reception time must be
+             * set first, as the ICAO address cache depends on it. */
+            mm.offset = c->offset + j;
+            mm.source = c->source;
+            mm.timestamp = c->timestamp + (uint64_t)mm.offset * MODES_CLOCK_PER_SAMPLE;
+            mm.ms = c->ms + (long long)mm.offset * 1000 / MODES_DEFAULT_RATE;
             decodeModesMessage(&mm, msg);
 
-            /* Update statistics. */
-            if (mm.crcok || use_correction) {
-                if (errors == 0)
-                    Modes.stat_demodulated++;
-                if (mm.errorbit == -1) {
-                    if (mm.crcok)
-                        Modes.stat_goodcrc++;
-                    else
-                        Modes.stat_badcrc++;
-                } else {
-                    Modes.stat_badcrc++;
-                    Modes.stat_fixed++;
-                    if (mm.errorbit < MODES_LONG_MSG_BITS)
-                        Modes.stat_single_bit_fix++;
-                    else
-                        Modes.stat_two_bits_fix++;
-                }
+            /* The signal level is the mean magnitude of the high half of
+             * every bit, scaled to a byte. */
+            for (i = 0; i < msglen * 8 * 2; i += 2) {
+                uint16_t high = m[j + i + MODES_PREAMBLE_US * 2];
+                uint16_t low = m[j + i + MODES_PREAMBLE_US * 2 + 1];
+
+                level += high > low ? high : low;
             }
+            mm.signal = level / (msglen * 8) >> 8;
 
             /* Skip this message if we are sure it's fine. */
             if (mm.crcok) {
@@ -729,8 +921,8 @@ void detectModeS(uint16_t* m, uint32_t mlen)
                     mm.phase_corrected = 1;
             }
 
-            /* Pass data to the next layer */
-            useModesMessage(&mm);
+            /* Collect it for the next layer */
+            demodCollect(c, &mm, errors, use_correction);
         }
 
         /* Retry with phase correction if possible. */
@@ -743,6 +935,179 @@ void detectModeS(uint16_t* m, uint32_t mlen)
     }
 }
 
+/* Update statistics and pass the message to the next layer. */
+static void demodAccept(struct demodMessage* dm)
+{
+    struct modesMessage* mm = &dm->mm;
+
+    if (mm->crcok || dm->use_correction) {
+        if (dm->errors == 0)
+            Modes.stat_demodulated++;
+        if (mm->errorbit == -1) {
+            if (mm->crcok)
+                Modes.stat_goodcrc++;
+            else
+                Modes.stat_badcrc++;
+        } else {
+            Modes.stat_badcrc++;
+            Modes.stat_fixed++;
+            if (mm->errorbit < MODES_LONG_MSG_BITS)
+                Modes.stat_single_bit_fix++;
+            else
+                Modes.stat_two_bits_fix++;
+        }
+    }
+    useModesMessage(mm);
+}
+
+/* Process chunks until none is left. Called with Modes.demod_mutex held. */
+static void demodRunChunks(void)
+{
+    while (Modes.demod_next < Modes.demod_nchunks) {
+        struct demodChunk* c = &Modes.demod_chunks[Modes.demod_next++];
+
+        pthread_mutex_unlock(&Modes.demod_mutex);
+        detectModeSChunk(c);
+        pthread_mutex_lock(&Modes.demod_mutex);
+        if (--Modes.demod_pending == 0)
+            pthread_cond_signal(&Modes.demod_done);
+    }
+}
+
+/* Demodulation worker: wait for a new block to be split in chunks by
+ * detectModeS(), and help processing them. */
+static void* demodWorkerEntryPoint(void* arg)
+{
+    unsigned int generation = 0;
+
+    MODES_NOTUSED(arg);
+
+    pthread_mutex_lock(&Modes.demod_mutex);
+    while (1) {
+        while (Modes.demod_generation == generation)
+            pthread_cond_wait(&Modes.demod_cond, &Modes.demod_mutex);
+        generation = Modes.demod_generation;
+        demodRunChunks();
+    }
+    return NULL;
+}
+
+/* Start the demodulation workers. The main thread processes chunks too, so
+ * Modes.demod_threads - 1 workers are created. */
+void modesInitDemod(void)
+{
+    int j;
+
+    Modes.demod_nchunks = 0;
+    Modes.demod_next = 0;
+    Modes.demod_pending = 0;
+    Modes.demod_generation = 0;
+    if ((Modes.demod_chunks = calloc(Modes.demod_threads, sizeof(struct demodChunk))) == NULL) {
+        fprintf(stderr, "Out of memory allocating demodulation chunks.\n");
+        exit(1);
+    }
+    pthread_mutex_init(&Modes.demod_mutex, NULL);
+    pthread_cond_init(&Modes.demod_cond, NULL);
+    pthread_cond_init(&Modes.demod_done, NULL);
+    for (j = 1; j < Modes.demod_threads; j++) {
+        pthread_t worker;
+
+        pthread_create(&worker, NULL, demodWorkerEntryPoint, NULL);
+        pthread_detach(worker);
+    }
+}
+
+/* Describe the samples of 'm' from 'start' to 'end' as a chunk, with the
+ * MODES_FULL_LEN * 2 following samples. 'timestamp' and 'ms' are the
+ * clocks of m[0]. */
+static void demodSetChunk(struct demodChunk* c, uint16_t* m, uint32_t start, uint32_t end,
+    uint64_t timestamp, long long ms, int source)
+{
+    c->m = m + start;
+    c->mlen = end - start + MODES_FULL_LEN * 2;
+    c->offset = start;
+    c->timestamp = timestamp;
+    c->ms = ms;
+    c->source = source;
+    c->nmsgs = 0;
+    c->stat_valid_preamble = 0;
+    c->stat_out_of_phase = 0;
+}
+
+/* Pass the messages of the 'n' consecutive chunks to the next layer, in
+ * sample order. Like detectModeSChunk() does inside a chunk, after a
+ * message with a good CRC the samples it covers are skipped: this removes
+ * the duplicates found by the next chunk at the seam. */
+void demodUseChunks(struct demodChunk* chunks, int n)
+{
+    uint32_t covered = 0; /* Samples before this offset are decoded. */
+    int j, k;
+
+    for (k = 0; k < n; k++) {
+        struct demodChunk* c = &chunks[k];
+
+        Modes.stat_valid_preamble += c->stat_valid_preamble;
+        Modes.stat_out_of_phase += c->stat_out_of_phase;
+        for (j = 0; j < c->nmsgs; j++) {
+            struct modesMessage* mm = &c->msgs[j].mm;
+
+            if (mm->offset < covered)
+                continue; /* Already decoded by the previous chunk. */
+            if (mm->crcok)
+                covered = mm->offset + (MODES_PREAMBLE_US + mm->msgbits) * 2;
+            demodAccept(&c->msgs[j]);
+        }
+    }
+}
+
+/* Detect Mode S messages inside the magnitude buffer pointed by 'm' and of
+ * size 'mlen' samples, and pass them to the next layer. 'timestamp' and
+ * 'ms' are the clocks of m[0].
+ *
+ * The offsets to test are split in Modes.demod_threads chunks, and every
+ * chunk also gets the MODES_FULL_LEN * 2 following samples, so that the
+ * messages starting near its end can be demodulated. Messages are then
+ * merged in sample order by demodUseChunks(). */
+void detectModeS(uint16_t* m, uint32_t mlen, uint64_t timestamp, long long ms)
+{
+    uint32_t limit = mlen - MODES_FULL_LEN * 2;
+    int n = Modes.demod_threads;
+    int k;
+
+    for (k = 0; k < n; k++) {
+        demodSetChunk(&Modes.demod_chunks[k], m, (uint64_t)limit * k / n,
+            (uint64_t)limit * (k + 1) / n, timestamp, ms, 0);
+    }
+
+    pthread_mutex_lock(&Modes.demod_mutex);
+    Modes.demod_nchunks = n;
+    Modes.demod_next = 0;
+    Modes.demod_pending = n;
+    if (n > 1) {
+        Modes.demod_generation++;
+        pthread_cond_broadcast(&Modes.demod_cond);
+    }
+    demodRunChunks();
+    while (Modes.demod_pending)
+        pthread_cond_wait(&Modes.demod_done, &Modes.demod_mutex);
+    pthread_mutex_unlock(&Modes.demod_mutex);
+
+    demodUseChunks(Modes.demod_chunks, n);
+}
+
+/* Variant of detectModeS() for a receiver with its own demodulator thread:
+ * the whole buffer is demodulated by the calling thread in the chunk 'c',
+ * without the worker pool, and messages are tagged with 'source'. They are
+ * only collected: the caller passes them to the next layer with
+ * demodUseChunks(), that is the only part to be serialized with the other
+ * receivers. */
+void detectModeSAlone(struct demodChunk* c, uint16_t* m, uint32_t mlen,
+    uint64_t timestamp, long long ms, int source)
+{
+    demodSetChunk(c, m, 0, mlen - MODES_FULL_LEN * 2, timestamp, ms, source);
+    detectModeSChunk(c);
+}
+
 /* When a new message is available, because it was decoded from the
  * RTL device, file, or received in the TCP input port, or any other
  * way we can receive a decoded message, we call this function in order
@@ -753,10 +1118,25 @@ void detectModeS(uint16_t* m, uint32_t mlen)
 void useModesMessage(struct modesMessage* mm)
 {
     if (Modes.check_crc == 0 || mm->crcok) {
-        /* Track aircrafts in interactive mode or if the HTTP
-         * interface is enabled. */
-        if (Modes.interactive || Modes.stat_http_requests > 0 || Modes.stat_sbs_connections > 0) {
-            struct aircraft* a = interactiveReceiveData(mm);
+        struct aircraft* a = NULL;
+
+        /* With several receivers or feeders, keep a single copy of every
+         * frame. */
+        if ((Modes.ndevices > 1 || (Modes.net && Modes.services[MODES_NET_SERVICE_RAW_IN].clients))
+            && mergeIsDuplicate(mm))
+            return;
+
+        /* Track aircrafts in interactive mode or as soon as the HTTP
+         * interface listens, so that the first request already finds them. */
+        if (Modes.interactive || (Modes.net && Modes.services[MODES_NET_SERVICE_HTTP].fd != -1)
+            || Modes.stat_sbs_connections > 0) {
+            a = interactiveReceiveData(mm);
+        }
+        /* Feed the network output clients. */
+        if (Modes.net) {
+            modesSendSBSOutput(mm, a);
+            modesSendRawOutput(mm);
+            modesSendBeastOutput(mm);
         }
     }
 }
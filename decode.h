@@ -1,9 +1,18 @@
 #ifndef DECODE_H
 #define DECODE_H
 
+#include "data.h"
 #include <stdint.h>
 
-void computeMagnitudeVector(void);
-void detectModeS(uint16_t*, uint32_t);
+void modesInitChecksum(void);
+void modesInitSyndromes(void);
+void modesInitICAOCache(void);
+void modesInitDemod(void);
+void detectModeS(uint16_t*, uint32_t, uint64_t, long long);
+void detectModeSAlone(struct demodChunk*, uint16_t*, uint32_t, uint64_t, long long, int);
+void demodUseChunks(struct demodChunk*, int);
+uint32_t ICAOHashAddress(uint32_t);
+void decodeModesMessage(struct modesMessage*, unsigned char*);
+void useModesMessage(struct modesMessage*);
 
 #endif //DECODE_H
\ No newline at end of file
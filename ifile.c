@@ -0,0 +1,67 @@
+#include "ifile.h"
+#include "data.h"
+#include "ring.h"
+
+extern struct Modes Modes;
+
+/* ============================== File input ================================ */
+
+/* Map the raw IQ capture in memory. The file is expected to contain 8 bit
+ * unsigned I/Q pairs, as produced by rtl_sdr. */
+void modesInitFile(void)
+{
+    struct stat st;
+    int fd;
+
+    if ((fd = open(Modes.filename, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Error opening the input file '%s': %s\n",
+            Modes.filename, strerror(errno));
+        exit(1);
+    }
+    /* Ignore a trailing half I/Q pair. */
+    Modes.file_len = st.st_size & ~(off_t)1;
+    Modes.file_data = NULL;
+    if (Modes.file_len) {
+        Modes.file_data = mmap(NULL, Modes.file_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (Modes.file_data == MAP_FAILED) {
+            fprintf(stderr, "Error mapping the input file '%s': %s\n",
+                Modes.filename, strerror(errno));
+            exit(1);
+        }
+        madvise(Modes.file_data, Modes.file_len, MADV_SEQUENTIAL);
+    }
+    close(fd);
+}
+
+/* Feed the mapped file to the decoder block by block. Blocks are lent to
+ * the decoder straight from the mapping, so nothing is copied and nothing
+ * is dropped: we just wait for the decoder to be done with every block.
+ *
+ * In real time mode every block is delivered no sooner than it would be
+ * by a device sampling at MODES_DEFAULT_RATE. */
+void* fileReaderThreadEntryPoint(void* arg)
+{
+    struct timespec start, next;
+    long long block_ns = (long long)MODES_DATA_LEN / 2 * 1000000000 / MODES_DEFAULT_RATE;
+    size_t off;
+
+    MODES_NOTUSED(arg);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    next = start;
+    for (off = 0; off < Modes.file_len && !Modes.exit; off += MODES_DATA_LEN) {
+        size_t len = Modes.file_len - off;
+
+        if (len > MODES_DATA_LEN)
+            len = MODES_DATA_LEN;
+        if (Modes.realtime) {
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+            next.tv_nsec += block_ns;
+            next.tv_sec += next.tv_nsec / 1000000000;
+            next.tv_nsec %= 1000000000;
+        }
+        ringLend(&Modes.ring, Modes.file_data + off, len);
+    }
+    ringClose(&Modes.ring);
+    return NULL;
+}
@@ -0,0 +1,7 @@
+#ifndef IFILE_H
+#define IFILE_H
+
+void* fileReaderThreadEntryPoint(void*);
+void modesInitFile(void);
+
+#endif //IFILE_H
@@ -1,30 +1,112 @@
 #include "interactive.h"
 #include "data.h"
+#include <stdarg.h>
+#include "decode.h"
 #include "gps.h"
+#include "ring.h"
 
 extern struct Modes Modes;
 
 /* ============================= Utility functions ========================== */
 
+/* Return milliseconds of a monotonic clock. Message reception times and
+ * everything compared with them use this clock. */
 long long mstime(void)
 {
-    struct timeval tv;
-    long long mst;
+    struct timespec ts;
 
-    gettimeofday(&tv, NULL);
-    mst = ((long long)tv.tv_sec) * 1000;
-    mst += tv.tv_usec / 1000;
-    return mst;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 /* ========================= Interactive mode =============================== */
 
+/* Aircraft records are taken from slabs of Modes.aircraft_pool records
+ * instead of being malloc()ed and freed one by one, so that aircrafts
+ * appearing and disappearing all day long don't fragment the heap. Slabs
+ * are only added when every record is in use, up to --aircraft-max. */
+
+/* Allocate a new slab and put its records in the free list. Returns 0 on
+ * success, -1 if the limit was reached or memory is exhausted. */
+static int aircraftPoolGrow(void)
+{
+    uint32_t len = Modes.aircraft_pool;
+    struct aircraftSlab* slab;
+    uint32_t j;
+
+    if (Modes.aircraft_max) {
+        if (Modes.aircraft_records >= (uint32_t)Modes.aircraft_max)
+            return -1;
+        if (len > Modes.aircraft_max - Modes.aircraft_records)
+            len = Modes.aircraft_max - Modes.aircraft_records;
+    }
+    slab = malloc(sizeof(*slab) + sizeof(struct aircraft) * len);
+    if (!slab)
+        return -1;
+    slab->len = len;
+    slab->next = Modes.aircraft_slabs;
+    Modes.aircraft_slabs = slab;
+    for (j = len; j > 0; j--) {
+        slab->records[j - 1].next = Modes.aircraft_free;
+        Modes.aircraft_free = &slab->records[j - 1];
+    }
+    Modes.aircraft_records += len;
+    return 0;
+}
+
+/* Take a record from the pool, or return NULL if none is available. */
+static struct aircraft* aircraftAlloc(void)
+{
+    struct aircraft* a;
+
+    if (!Modes.aircraft_free && aircraftPoolGrow() == -1) {
+        Modes.stat_aircraft_failed++;
+        return NULL;
+    }
+    a = Modes.aircraft_free;
+    Modes.aircraft_free = a->next;
+    if (++Modes.stat_aircraft_live > Modes.stat_aircraft_peak)
+        Modes.stat_aircraft_peak = Modes.stat_aircraft_live;
+    return a;
+}
+
+/* Give the record back to the pool. */
+static void aircraftFree(struct aircraft* a)
+{
+    a->next = Modes.aircraft_free;
+    Modes.aircraft_free = a;
+    Modes.stat_aircraft_live--;
+}
+
+/* Set up the aircraft table and preallocate the first slab of records. */
+void modesInitAircrafts(void)
+{
+    Modes.aircrafts = NULL;
+    Modes.aircraft_table_len = MODES_AIRCRAFT_TABLE_LEN;
+    Modes.aircraft_count = 0;
+    Modes.aircraft_table = calloc(Modes.aircraft_table_len, sizeof(struct aircraft*));
+    Modes.aircraft_slabs = NULL;
+    Modes.aircraft_free = NULL;
+    Modes.aircraft_records = 0;
+    memset(Modes.expiry_wheel, 0, sizeof(Modes.expiry_wheel));
+    Modes.expiry_last = mstime() / 1000;
+    Modes.stat_aircraft_live = 0;
+    Modes.stat_aircraft_peak = 0;
+    Modes.stat_aircraft_failed = 0;
+    if (!Modes.aircraft_table || aircraftPoolGrow() == -1) {
+        fprintf(stderr, "Out of memory allocating the aircraft table.\n");
+        exit(1);
+    }
+}
+
 /* Return a new aircraft structure for the interactive mode linked list
- * of aircrafts. */
-struct aircraft* interactiveCreateAircraft(uint32_t addr)
+ * of aircrafts, seen at 'seen', or NULL if the pool is exhausted. */
+struct aircraft* interactiveCreateAircraft(uint32_t addr, time_t seen)
 {
-    struct aircraft* a = malloc(sizeof(*a));
+    struct aircraft* a = aircraftAlloc();
 
+    if (!a)
+        return NULL;
     a->addr = addr;
     snprintf(a->hexaddr, sizeof(a->hexaddr), "%06x", (int)addr);
     a->flight[0] = '\0';
@@ -40,26 +122,144 @@ struct aircraft* interactiveCreateAircraft(uint32_t addr)
     a->lat = 0;
     a->lon = 0;
     a->distance = 0;
-    a->seen = time(NULL);
+    a->position_time = 0;
+    a->seen = seen;
     a->messages = 0;
     a->next = NULL;
+    a->prev = NULL;
+    a->expire_next = NULL;
     return a;
 }
 
+/* Aircrafts are indexed by ICAO address in an open addressing hash table
+ * with linear probing, Modes.aircraft_table, so that finding the aircraft
+ * of every message takes the same time whatever the number of aircrafts.
+ * The table owns the aircraft records: an aircraft goes back to the pool
+ * when removed from the table. The display order is the separate Modes.aircrafts
+ * linked list. */
+
 /* Return the aircraft with the specified address, or NULL if no aircraft
  * exists with this address. */
 struct aircraft* interactiveFindAircraft(uint32_t addr)
 {
-    struct aircraft* a = Modes.aircrafts;
+    uint32_t mask = Modes.aircraft_table_len - 1;
+    uint32_t h = ICAOHashAddress(addr) & mask;
+    struct aircraft* a;
 
-    while (a) {
+    while ((a = Modes.aircraft_table[h])) {
         if (a->addr == addr)
             return a;
-        a = a->next;
+        h = (h + 1) & mask;
     }
     return NULL;
 }
 
+/* Put the aircraft in the first free slot of its probe sequence. */
+static void aircraftTableInsert(struct aircraft** table, uint32_t len, struct aircraft* a)
+{
+    uint32_t h = ICAOHashAddress(a->addr) & (len - 1);
+
+    while (table[h])
+        h = (h + 1) & (len - 1);
+    table[h] = a;
+}
+
+/* Add a new aircraft to the table, doubling its size when half full. */
+static void aircraftTableAdd(struct aircraft* a)
+{
+    if ((Modes.aircraft_count + 1) * 2 > Modes.aircraft_table_len) {
+        uint32_t len = Modes.aircraft_table_len * 2;
+        struct aircraft** table = calloc(len, sizeof(struct aircraft*));
+        uint32_t j;
+
+        if (!table) {
+            fprintf(stderr, "Out of memory growing the aircraft table.\n");
+            exit(1);
+        }
+        for (j = 0; j < Modes.aircraft_table_len; j++) {
+            if (Modes.aircraft_table[j])
+                aircraftTableInsert(table, len, Modes.aircraft_table[j]);
+        }
+        free(Modes.aircraft_table);
+        Modes.aircraft_table = table;
+        Modes.aircraft_table_len = len;
+    }
+    aircraftTableInsert(Modes.aircraft_table, Modes.aircraft_table_len, a);
+    Modes.aircraft_count++;
+}
+
+/* Remove the aircraft from the table and release its record. The following entries of
+ * the probe sequence are shifted back, so that no tombstone is needed. */
+static void aircraftTableDelete(struct aircraft* a)
+{
+    uint32_t mask = Modes.aircraft_table_len - 1;
+    uint32_t i = ICAOHashAddress(a->addr) & mask;
+    uint32_t j;
+
+    while (Modes.aircraft_table[i] != a)
+        i = (i + 1) & mask;
+    Modes.aircraft_table[i] = NULL;
+    j = i;
+    while (1) {
+        uint32_t k;
+
+        j = (j + 1) & mask;
+        if (!Modes.aircraft_table[j])
+            break;
+        /* Entry 'j' can fill the hole in 'i' only if its home slot 'k' is
+         * not cyclically in (i, j]. */
+        k = ICAOHashAddress(Modes.aircraft_table[j]->addr) & mask;
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            Modes.aircraft_table[i] = Modes.aircraft_table[j];
+            Modes.aircraft_table[j] = NULL;
+            i = j;
+        }
+    }
+    Modes.aircraft_count--;
+    aircraftFree(a);
+}
+
+/* Add the aircraft on head of the display list. */
+static void aircraftListPush(struct aircraft* a)
+{
+    a->prev = NULL;
+    a->next = Modes.aircrafts;
+    if (Modes.aircrafts)
+        Modes.aircrafts->prev = a;
+    Modes.aircrafts = a;
+}
+
+/* Remove the aircraft from the display list. */
+static void aircraftListUnlink(struct aircraft* a)
+{
+    if (a->prev)
+        a->prev->next = a->next;
+    else
+        Modes.aircrafts = a->next;
+    if (a->next)
+        a->next->prev = a->prev;
+}
+
+/* Stale aircrafts are found with a timing wheel: Modes.expiry_wheel has a
+ * bucket for every second, and an aircraft is in the bucket of the second
+ * at which it would become stale if no other message was received. The
+ * bucket is not updated for every message: when its second comes, every
+ * aircraft of the bucket that was seen in the meantime is simply moved to
+ * the bucket of its new expiry time. So every refresh only touches the
+ * aircrafts that were due, and each aircraft is touched at most once per
+ * TTL. Deadlines more than MODES_EXPIRY_WHEEL_LEN seconds away just take
+ * more than one turn of the wheel. */
+
+/* Put the aircraft in the bucket of its expiry time. */
+static void aircraftExpiryAdd(struct aircraft* a)
+{
+    time_t expire = a->seen + Modes.interactive_ttl + 1;
+    struct aircraft** bucket = &Modes.expiry_wheel[expire & (MODES_EXPIRY_WHEEL_LEN - 1)];
+
+    a->expire_next = *bucket;
+    *bucket = a;
+}
+
 /* Always positive MOD operation, used for CPR decoding. */
 int cprModFunction(int a, int b)
 {
@@ -69,129 +269,62 @@ int cprModFunction(int a, int b)
     return res;
 }
 
-/* The NL function uses the precomputed table from 1090-WP-9-14 */
+/* The NL function uses the precomputed table from 1090-WP-9-14: NL is 59
+ * below the first latitude and decreases by one at every following one,
+ * down to 2. It is 1 from 87 degrees on. */
+static const double cpr_nl_lat[57] = {
+    10.47047130, 14.82817437, 18.18626357, 21.02939493,
+    23.54504487, 25.82924707, 27.93898710, 29.91135686,
+    31.77209708, 33.53993436, 35.22899598, 36.85025108,
+    38.41241892, 39.92256684, 41.38651832, 42.80914012,
+    44.19454951, 45.54626723, 46.86733252, 48.16039128,
+    49.42776439, 50.67150166, 51.89342469, 53.09516153,
+    54.27817472, 55.44378444, 56.59318756, 57.72747354,
+    58.84763776, 59.95459277, 61.04917774, 62.13216659,
+    63.20427479, 64.26616523, 65.31845310, 66.36171008,
+    67.39646774, 68.42322022, 69.44242631, 70.45451075,
+    71.45986473, 72.45884545, 73.45177442, 74.43893416,
+    75.42056257, 76.39684391, 77.36789461, 78.33374083,
+    79.29428225, 80.24923213, 81.19801349, 82.13956981,
+    83.07199445, 83.99173563, 84.89166191, 85.75541621,
+    86.53536998
+};
+
+/* The latitudes are at least 0.46 degrees apart, so a quarter of a degree
+ * never contains more than one of them. For every quarter of a degree up
+ * to 87 we keep NL at its start and the latitude, if any, from which NL is
+ * one less, so that NL is found with a single comparison. */
+#define CPR_NL_STEPS 4 /* Table entries per degree. */
+static struct {
+    double split; /* NL is one less from this latitude on. */
+    int nl;
+} cpr_nl_table[87 * CPR_NL_STEPS];
+
+void modesInitCPR(void)
+{
+    int i, k = 0;
+
+    for (i = 0; i < 87 * CPR_NL_STEPS; i++) {
+        double start = (double)i / CPR_NL_STEPS;
+        double end = (double)(i + 1) / CPR_NL_STEPS;
+
+        while (k < 57 && cpr_nl_lat[k] <= start)
+            k++;
+        cpr_nl_table[i].nl = 59 - k;
+        cpr_nl_table[i].split = (k < 57 && cpr_nl_lat[k] < end) ? cpr_nl_lat[k] : end;
+    }
+}
+
 int cprNLFunction(double lat)
 {
+    int i;
+
     if (lat < 0)
         lat = -lat; /* Table is simmetric about the equator. */
-    if (lat < 10.47047130)
-        return 59;
-    if (lat < 14.82817437)
-        return 58;
-    if (lat < 18.18626357)
-        return 57;
-    if (lat < 21.02939493)
-        return 56;
-    if (lat < 23.54504487)
-        return 55;
-    if (lat < 25.82924707)
-        return 54;
-    if (lat < 27.93898710)
-        return 53;
-    if (lat < 29.91135686)
-        return 52;
-    if (lat < 31.77209708)
-        return 51;
-    if (lat < 33.53993436)
-        return 50;
-    if (lat < 35.22899598)
-        return 49;
-    if (lat < 36.85025108)
-        return 48;
-    if (lat < 38.41241892)
-        return 47;
-    if (lat < 39.92256684)
-        return 46;
-    if (lat < 41.38651832)
-        return 45;
-    if (lat < 42.80914012)
-        return 44;
-    if (lat < 44.19454951)
-        return 43;
-    if (lat < 45.54626723)
-        return 42;
-    if (lat < 46.86733252)
-        return 41;
-    if (lat < 48.16039128)
-        return 40;
-    if (lat < 49.42776439)
-        return 39;
-    if (lat < 50.67150166)
-        return 38;
-    if (lat < 51.89342469)
-        return 37;
-    if (lat < 53.09516153)
-        return 36;
-    if (lat < 54.27817472)
-        return 35;
-    if (lat < 55.44378444)
-        return 34;
-    if (lat < 56.59318756)
-        return 33;
-    if (lat < 57.72747354)
-        return 32;
-    if (lat < 58.84763776)
-        return 31;
-    if (lat < 59.95459277)
-        return 30;
-    if (lat < 61.04917774)
-        return 29;
-    if (lat < 62.13216659)
-        return 28;
-    if (lat < 63.20427479)
-        return 27;
-    if (lat < 64.26616523)
-        return 26;
-    if (lat < 65.31845310)
-        return 25;
-    if (lat < 66.36171008)
-        return 24;
-    if (lat < 67.39646774)
-        return 23;
-    if (lat < 68.42322022)
-        return 22;
-    if (lat < 69.44242631)
-        return 21;
-    if (lat < 70.45451075)
-        return 20;
-    if (lat < 71.45986473)
-        return 19;
-    if (lat < 72.45884545)
-        return 18;
-    if (lat < 73.45177442)
-        return 17;
-    if (lat < 74.43893416)
-        return 16;
-    if (lat < 75.42056257)
-        return 15;
-    if (lat < 76.39684391)
-        return 14;
-    if (lat < 77.36789461)
-        return 13;
-    if (lat < 78.33374083)
-        return 12;
-    if (lat < 79.29428225)
-        return 11;
-    if (lat < 80.24923213)
-        return 10;
-    if (lat < 81.19801349)
-        return 9;
-    if (lat < 82.13956981)
-        return 8;
-    if (lat < 83.07199445)
-        return 7;
-    if (lat < 83.99173563)
-        return 6;
-    if (lat < 84.89166191)
-        return 5;
-    if (lat < 85.75541621)
-        return 4;
-    if (lat < 86.53536998)
-        return 3;
-    if (lat < 87.00000000)
-        return 2;
-    else
+    if (!(lat < 87.0))
         return 1;
+    i = lat * CPR_NL_STEPS;
+    return cpr_nl_table[i].nl - (lat >= cpr_nl_table[i].split);
 }
 
 int cprNFunction(double lat, int isodd)
@@ -207,6 +340,27 @@ double cprDlonFunction(double lat, int isodd)
     return 360.0 / cprNFunction(lat, isodd);
 }
 
+/* Set the position of the aircraft, unless it is farther than
+ * Modes.max_range from the receiver, in which case it can only be a wrong
+ * decoding. Returns 1 if the position was accepted. */
+static int aircraftSetPosition(struct aircraft* a, double lat, double lon, long long ms)
+{
+    double distance;
+
+    if (lon > 180)
+        lon -= 360;
+    else if (lon < -180)
+        lon += 360;
+    distance = distanceOnEarth(lat, lon, Modes.lat, Modes.lon);
+    if ((Modes.lat != 0 || Modes.lon != 0) && distance > Modes.max_range)
+        return 0;
+    a->lat = lat;
+    a->lon = lon;
+    a->distance = distance;
+    a->position_time = ms;
+    return 1;
+}
+
 /* This algorithm comes from:
  * http://www.lll.lu/~edward/edward/adsb/DecodingADSBposition.html.
  *
@@ -216,8 +370,9 @@ double cprDlonFunction(double lat, int isodd)
  * 2) We assume that we always received the odd packet as last packet for
  *    simplicity. This may provide a position that is less fresh of a few
  *    seconds.
- */
-void decodeCPR(struct aircraft* a)
+ *
+ * Returns 1 if a position was decoded. */
+int decodeCPR(struct aircraft* a)
 {
     const double AirDlat0 = 360.0 / 60;
     const double AirDlat1 = 360.0 / 59;
@@ -238,33 +393,75 @@ void decodeCPR(struct aircraft* a)
 
     /* Check that both are in the same latitude zone, or abort. */
     if (cprNLFunction(rlat0) != cprNLFunction(rlat1))
-        return;
+        return 0;
 
     /* Compute ni and the longitude index m */
     if (a->even_cprtime > a->odd_cprtime) {
         /* Use even packet. */
         int ni = cprNFunction(rlat0, 0);
         int m = floor((((lon0 * (cprNLFunction(rlat0) - 1)) - (lon1 * cprNLFunction(rlat0))) / 131072) + 0.5);
-        a->lon = cprDlonFunction(rlat0, 0) * (cprModFunction(m, ni) + lon0 / 131072);
-        a->lat = rlat0;
+        return aircraftSetPosition(a, rlat0,
+            cprDlonFunction(rlat0, 0) * (cprModFunction(m, ni) + lon0 / 131072),
+            a->even_cprtime);
     } else {
         /* Use odd packet. */
         int ni = cprNFunction(rlat1, 1);
         int m = floor((((lon0 * (cprNLFunction(rlat1) - 1)) - (lon1 * cprNLFunction(rlat1))) / 131072.0) + 0.5);
-        a->lon = cprDlonFunction(rlat1, 1) * (cprModFunction(m, ni) + lon1 / 131072);
-        a->lat = rlat1;
+        return aircraftSetPosition(a, rlat1,
+            cprDlonFunction(rlat1, 1) * (cprModFunction(m, ni) + lon1 / 131072),
+            a->odd_cprtime);
     }
-    if (a->lon > 180)
-        a->lon -= 360;
+}
 
-    a->distance = distanceOnEarth(a->lat, a->lon, Modes.lat, Modes.lon);
+/* Locally unambiguous CPR decoding: a single odd or even message is enough
+ * when a reference position no more than half a zone away (about 180 NM)
+ * is known, since the reference selects the zone the aircraft is in. The
+ * reference is the last position of the aircraft if it is not older than
+ * MODES_CPR_LOCAL_TTL, otherwise the receiver position if --lat / --lon
+ * were given. In the latter case an aircraft actually farther than about
+ * 660 km minus --max-range would be misplaced, so --max-range should not
+ * be much more than the real coverage of the receiver.
+ *
+ * Returns 1 if a position was decoded. */
+int decodeCPRLocal(struct aircraft* a, int fflag, int cprlat, int cprlon, long long ms)
+{
+    double reflat, reflon;
+    double dlat, dlon, rlat;
+    int j, m;
+
+    /* The decoder keeps the F bit in place (1<<2), not as 0/1. */
+    fflag = fflag != 0;
+    dlat = 360.0 / (fflag ? 59 : 60);
+
+    if (a->position_time && ms - a->position_time <= MODES_CPR_LOCAL_TTL * 1000) {
+        reflat = a->lat;
+        reflon = a->lon;
+    } else if (Modes.lat != 0 || Modes.lon != 0) {
+        reflat = Modes.lat;
+        reflon = Modes.lon;
+    } else {
+        return 0;
+    }
+
+    /* Latitude zone of the reference, corrected by the position inside the
+     * zone so that the result is the closest to the reference. */
+    j = floor(reflat / dlat) + floor(0.5 + fmod(reflat + 360, dlat) / dlat - cprlat / 131072.0);
+    rlat = dlat * (j + cprlat / 131072.0);
+    if (rlat < -90 || rlat > 90)
+        return 0;
+
+    /* Same for the longitude, zones depend on the latitude. */
+    dlon = cprDlonFunction(rlat, fflag);
+    m = floor(reflon / dlon) + floor(0.5 + fmod(reflon + 360, dlon) / dlon - cprlon / 131072.0);
+    return aircraftSetPosition(a, rlat, dlon * (m + cprlon / 131072.0), ms);
 }
 
 /* Receive new messages and populate the interactive mode with more info. */
 struct aircraft* interactiveReceiveData(struct modesMessage* mm)
 {
     uint32_t addr;
-    struct aircraft *a, *aux;
+    struct aircraft* a;
+    time_t seen = mm->ms / 1000;
 
     if (Modes.check_crc && mm->crcok == 0)
         return NULL;
@@ -273,9 +470,12 @@ struct aircraft* interactiveReceiveData(struct modesMessage* mm)
     /* Loookup our aircraft or create a new one. */
     a = interactiveFindAircraft(addr);
     if (!a) {
-        a = interactiveCreateAircraft(addr);
-        a->next = Modes.aircrafts;
-        Modes.aircrafts = a;
+        a = interactiveCreateAircraft(addr, seen);
+        if (!a)
+            return NULL;
+        aircraftTableAdd(a);
+        aircraftListPush(a);
+        aircraftExpiryAdd(a);
     } else {
         /* If it is an already known aircraft, move it on head
          * so we keep aircrafts ordered by received message time.
@@ -284,19 +484,13 @@ struct aircraft* interactiveReceiveData(struct modesMessage* mm)
          * since the aircraft that is currently on head sent a message,
          * othewise with multiple aircrafts at the same time we have an
          * useless shuffle of positions on the screen. */
-        if (0 && Modes.aircrafts != a && (time(NULL) - a->seen) >= 1) {
-            aux = Modes.aircrafts;
-            while (aux->next != a)
-                aux = aux->next;
-            /* Now we are a node before the aircraft to remove. */
-            aux->next = aux->next->next; /* removed. */
-            /* Add on head */
-            a->next = Modes.aircrafts;
-            Modes.aircrafts = a;
+        if (0 && Modes.aircrafts != a && (seen - a->seen) >= 1) {
+            aircraftListUnlink(a);
+            aircraftListPush(a);
         }
     }
 
-    a->seen = time(NULL);
+    a->seen = seen;
     a->messages++;
 
     if (mm->msgtype == 0 || mm->msgtype == 4 || mm->msgtype == 20) {
@@ -309,16 +503,18 @@ struct aircraft* interactiveReceiveData(struct modesMessage* mm)
             if (mm->fflag) {
                 a->odd_cprlat = mm->raw_latitude;
                 a->odd_cprlon = mm->raw_longitude;
-                a->odd_cprtime = mstime();
+                a->odd_cprtime = mm->ms;
             } else {
                 a->even_cprlat = mm->raw_latitude;
                 a->even_cprlon = mm->raw_longitude;
-                a->even_cprtime = mstime();
+                a->even_cprtime = mm->ms;
             }
             /* If the two data is less than 10 seconds apart, compute
-             * the position. */
-            if (abs(a->even_cprtime - a->odd_cprtime) <= 10000) {
-                decodeCPR(a);
+             * the position. Otherwise, or if the pair could not be
+             * decoded, use this message alone with a nearby reference. */
+            if (llabs(a->even_cprtime - a->odd_cprtime) > 10000 || !decodeCPR(a)) {
+                decodeCPRLocal(a, mm->fflag, mm->raw_latitude,
+                    mm->raw_longitude, mm->ms);
             }
         } else if (mm->metype == 19) {
             if (mm->mesub == 1 || mm->mesub == 2) {
@@ -330,26 +526,230 @@ struct aircraft* interactiveReceiveData(struct modesMessage* mm)
     return a;
 }
 
+/* The screen is drawn without clearing it: every frame is formatted in
+ * Modes.screen_frame, one line of Modes.screen_cols bytes per row, padded
+ * with spaces, and compared with the previous frame in Modes.screen. Only
+ * the part of each row between its first and last changed characters is
+ * sent to the terminal, and the whole update is sent with a single
+ * write(), which avoids flicker and saves bandwidth on slow links. */
+
+/* Resize the frame buffers to the terminal, and clear the screen when its
+ * size changed, so that the next frame is drawn in full. */
+static void screenResize(void)
+{
+    struct winsize ws;
+    int rows = MODES_INTERACTIVE_HEADER_ROWS + Modes.interactive_rows;
+    int cols = 80;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row && ws.ws_col) {
+        rows = ws.ws_row;
+        /* Never write the last column, some terminals would wrap. */
+        cols = ws.ws_col > 1 ? ws.ws_col - 1 : 1;
+    }
+    if (rows == Modes.screen_rows && cols == Modes.screen_cols)
+        return;
+
+    free(Modes.screen);
+    free(Modes.screen_frame);
+    free(Modes.screen_out);
+    Modes.screen = malloc(rows * cols);
+    Modes.screen_frame = malloc(rows * cols);
+    /* Worst case: every row is sent, with its cursor position. */
+    Modes.screen_out_size = rows * (cols + 16) + 16;
+    Modes.screen_out = malloc(Modes.screen_out_size);
+    if (!Modes.screen || !Modes.screen_frame || !Modes.screen_out) {
+        fprintf(stderr, "Out of memory allocating the screen.\n");
+        exit(1);
+    }
+    memset(Modes.screen, ' ', rows * cols);
+    Modes.screen_rows = rows;
+    Modes.screen_cols = cols;
+    Modes.screen_out_len = snprintf(Modes.screen_out, Modes.screen_out_size,
+        "\x1b[H\x1b[2J");
+}
+
+/* Format a row of the frame, truncated to the terminal width. */
+static void screenPrintf(int row, const char* fmt, ...)
+{
+    char* line = Modes.screen_frame + row * Modes.screen_cols;
+    char buf[256];
+    va_list ap;
+    int len;
+
+    if (row >= Modes.screen_rows)
+        return;
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        len = 0;
+    if (len > (int)sizeof(buf) - 1)
+        len = sizeof(buf) - 1;
+    if (len > Modes.screen_cols)
+        len = Modes.screen_cols;
+    memcpy(line, buf, len);
+    memset(line + len, ' ', Modes.screen_cols - len);
+}
+
+/* Send the differences between the new frame and the screen. */
+static void screenFlush(void)
+{
+    char* out = Modes.screen_out;
+    size_t len = Modes.screen_out_len;
+    int cols = Modes.screen_cols;
+    int row;
+
+    for (row = 0; row < Modes.screen_rows; row++) {
+        char* old = Modes.screen + row * cols;
+        char* new = Modes.screen_frame + row * cols;
+        int first = 0, last = cols - 1;
+
+        while (first < cols && old[first] == new[first])
+            first++;
+        if (first == cols)
+            continue;
+        while (old[last] == new[last])
+            last--;
+        len += snprintf(out + len, Modes.screen_out_size - len,
+            "\x1b[%d;%dH", row + 1, first + 1);
+        memcpy(out + len, new + first, last - first + 1);
+        len += last - first + 1;
+    }
+    memcpy(Modes.screen, Modes.screen_frame, Modes.screen_rows * cols);
+
+    out = Modes.screen_out;
+    while (len) {
+        ssize_t n = write(STDOUT_FILENO, out, len);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        out += n;
+        len -= n;
+    }
+    Modes.screen_out_len = 0;
+}
+
+/* Compare aircrafts for the --sort order. Ties are broken by address so
+ * that rows don't swap at every frame. */
+static int aircraftCompare(const void* p1, const void* p2)
+{
+    const struct aircraft* a = *(const struct aircraft* const*)p1;
+    const struct aircraft* b = *(const struct aircraft* const*)p2;
+    double d = 0;
+
+    switch (Modes.interactive_sort) {
+    case MODES_SORT_DISTANCE:
+        /* Aircrafts without a position go last. */
+        if (!a->position_time || !b->position_time)
+            d = (a->position_time == 0) - (b->position_time == 0);
+        else
+            d = a->distance - b->distance;
+        break;
+    case MODES_SORT_ALTITUDE:
+        d = b->altitude - a->altitude;
+        break;
+    case MODES_SORT_MESSAGES:
+        d = b->messages - a->messages;
+        break;
+    }
+    if (d == 0)
+        d = (double)a->addr - b->addr;
+    return (d > 0) - (d < 0);
+}
+
 /* Show the currently captured interactive data on screen. */
 void interactiveShowData(void)
 {
-    struct aircraft* a = Modes.aircrafts;
-    time_t now = time(NULL);
+    struct aircraft* a;
+    time_t now = mstime() / 1000;
     char progress[4];
-    int count = 0;
+    int rows, count = 0, row = 0;
 
+    screenResize();
     memset(progress, ' ', 3);
-    progress[time(NULL) % 3] = '.';
+    progress[now % 3] = '.';
     progress[3] = '\0';
 
-    printf("\x1b[H\x1b[2J"); /* Clear the screen */
-    printf(
-        "Hex    Flight   Altitude  Speed   Lat       Lon       Dst       Track  Messages Seen %s\n"
-        "----------------------------------------------------------------------------------------\n",
+    if (Modes.ndevices > 1) {
+        char line[256];
+        int len = snprintf(line, sizeof(line), "Devices:");
+        int j;
+
+        for (j = 0; j < Modes.ndevices && len < (int)sizeof(line); j++) {
+            struct sdrDevice* d = &Modes.devices[j];
+
+            len += snprintf(line + len, sizeof(line) - len, "%s#%d %lld msgs %lld dups %u dropped",
+                j ? " | " : " ", j, d->stat_goodcrc, d->stat_duplicates,
+                atomic_load(&d->ring->dropped));
+        }
+        screenPrintf(row++, "%s", line);
+    } else {
+        screenPrintf(row++, "IQ ring: %u/%u slots used, high water %u, dropped %u",
+            ringUsed(&Modes.ring), Modes.ring.depth,
+            atomic_load(&Modes.ring.high_water), atomic_load(&Modes.ring.dropped));
+    }
+    screenPrintf(row++, "Aircrafts: %lld live, %lld peak, %lld failed allocations, %u records",
+        Modes.stat_aircraft_live, Modes.stat_aircraft_peak,
+        Modes.stat_aircraft_failed, Modes.aircraft_records);
+    screenPrintf(row++, "ICAO cache: %lld hits, %lld misses, %lld evictions, %lld collisions",
+        atomic_load(&Modes.stat_icao_hits), atomic_load(&Modes.stat_icao_misses),
+        atomic_load(&Modes.stat_icao_evictions), atomic_load(&Modes.stat_icao_collisions));
+    screenPrintf(row++, "Network: %d feeders, %lld messages in, %lld duplicates, %lld bad bytes",
+        Modes.net ? Modes.services[MODES_NET_SERVICE_RAW_IN].clients : 0,
+        Modes.stat_net_input, Modes.stat_merge_duplicates, Modes.stat_net_input_errors);
+    if (Modes.net && Modes.services[MODES_NET_SERVICE_RAW_IN].clients) {
+        char line[256];
+        int len = snprintf(line, sizeof(line), "Feeders:");
+        int n = 0;
+        struct client* c;
+
+        for (c = Modes.client_list; c && len < (int)sizeof(line); c = c->next) {
+            if (c->fd == -1 || c->service != MODES_NET_SERVICE_RAW_IN)
+                continue;
+            len += snprintf(line + len, sizeof(line) - len, "%s#%d %lld msgs %lld dups (%.1f%%)",
+                n++ ? " | " : " ", c->fd, c->messages, c->duplicates,
+                c->messages ? 100.0 * c->duplicates / c->messages : 0.0);
+        }
+        screenPrintf(row++, "%s", line);
+    }
+    screenPrintf(row++,
+        "Hex    Flight   Altitude  Speed   Lat       Lon       Dst       Track  Messages Seen %s",
         progress);
+    screenPrintf(row++,
+        "----------------------------------------------------------------------------------------");
+
+    /* Only sort when asked to, otherwise show the display list as is. */
+    rows = Modes.screen_rows - row;
+    if (Modes.interactive_sort != MODES_SORT_NONE) {
+        if (Modes.screen_sorted_len < Modes.aircraft_count) {
+            Modes.screen_sorted_len = Modes.aircraft_table_len;
+            Modes.screen_sorted = realloc(Modes.screen_sorted,
+                sizeof(struct aircraft*) * Modes.screen_sorted_len);
+            if (!Modes.screen_sorted) {
+                fprintf(stderr, "Out of memory sorting aircrafts.\n");
+                exit(1);
+            }
+        }
+        for (a = Modes.aircrafts; a; a = a->next)
+            Modes.screen_sorted[count++] = a;
+        qsort(Modes.screen_sorted, count, sizeof(struct aircraft*), aircraftCompare);
+        if (rows > count)
+            rows = count;
+    }
 
-    while (a && count < Modes.interactive_rows) {
-        int altitude = a->altitude, speed = a->speed;
+    a = Modes.aircrafts;
+    for (count = 0; count < rows; count++) {
+        int altitude, speed;
+
+        if (Modes.interactive_sort != MODES_SORT_NONE)
+            a = Modes.screen_sorted[count];
+        else if (!a)
+            break;
+        altitude = a->altitude;
+        speed = a->speed;
 
         /* Convert units to metric if --metric was specified. */
         if (Modes.metric) {
@@ -357,37 +757,48 @@ void interactiveShowData(void)
             speed *= 1.852;
         }
 
-        printf("%-6s %-8s %-9d %-7d %-7.03f   %-7.03f   %-7.03f   %-3d   %-9ld %d sec\n",
+        screenPrintf(row++, "%-6s %-8s %-9d %-7d %-7.03f   %-7.03f   %-7.03f   %-3d   %-9ld %d sec",
             a->hexaddr, a->flight, altitude, speed,
             a->lat, a->lon, a->distance, a->track, a->messages,
             (int)(now - a->seen));
         a = a->next;
-        count++;
     }
+    /* Blank the rows of the aircrafts gone since the last frame. */
+    while (row < Modes.screen_rows)
+        screenPrintf(row++, "");
+    screenFlush();
 }
 
 /* When in interactive mode If we don't receive new nessages within
- * MODES_INTERACTIVE_TTL seconds we remove the aircraft from the list. */
+ * Modes.interactive_ttl seconds we remove the aircraft from the list.
+ * Only the buckets of the seconds elapsed since the last call are
+ * checked. */
 void interactiveRemoveStaleAircrafts(void)
 {
-    struct aircraft* a = Modes.aircrafts;
-    struct aircraft* prev = NULL;
-    time_t now = time(NULL);
-
-    while (a) {
-        if ((now - a->seen) > Modes.interactive_ttl) {
-            struct aircraft* next = a->next;
-            /* Remove the element from the linked list, with care
-             * if we are removing the first element. */
-            free(a);
-            if (!prev)
-                Modes.aircrafts = next;
-            else
-                prev->next = next;
+    time_t now = mstime() / 1000;
+    time_t t = Modes.expiry_last;
+    int buckets = 0;
+
+    while (t < now && buckets < MODES_EXPIRY_WHEEL_LEN) {
+        struct aircraft** bucket;
+        struct aircraft* a;
+
+        t++;
+        buckets++;
+        bucket = &Modes.expiry_wheel[t & (MODES_EXPIRY_WHEEL_LEN - 1)];
+        a = *bucket;
+        *bucket = NULL;
+        while (a) {
+            struct aircraft* next = a->expire_next;
+
+            if ((now - a->seen) > Modes.interactive_ttl) {
+                aircraftListUnlink(a);
+                aircraftTableDelete(a);
+            } else {
+                aircraftExpiryAdd(a);
+            }
             a = next;
-        } else {
-            prev = a;
-            a = a->next;
         }
     }
+    Modes.expiry_last = now;
 }
@@ -1,6 +1,8 @@
 #ifndef INTERACTIVE_H
 #define INTERACTIVE_H
 
+void modesInitAircrafts(void);
+void modesInitCPR(void);
 void interactiveRemoveStaleAircrafts(void);
 void interactiveShowData(void);
 long long mstime(void);
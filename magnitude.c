@@ -0,0 +1,247 @@
+#include "magnitude.h"
+#include "data.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+extern struct Modes Modes;
+
+/* ============================ Magnitude vector ============================ */
+
+/* Every kernel turns the 'len' bytes of I/Q samples pointed by 'p' into the
+ * magnitude vector pointed by 'm', and must produce exactly the values of
+ * Modes.maglut, so that decoding results don't depend on the kernel. */
+typedef void (*magnitudeKernel)(unsigned char*, uint16_t*, uint32_t);
+
+/* Kernel selected by modesInitMagnitude(). */
+static magnitudeKernel magnitude_kernel;
+
+/* Reference implementation. */
+static void magnitudeScalar(unsigned char* p, uint16_t* m, uint32_t len)
+{
+    uint32_t j;
+
+    /* Compute the magnitudo vector. It's just SQRT(I^2 + Q^2), but
+     * we rescale to the 0-255 range to exploit the full resolution. */
+    for (j = 0; j < len; j += 2) {
+        int i = p[j] - 127;
+        int q = p[j + 1] - 127;
+
+        if (i < 0)
+            i = -i;
+        if (q < 0)
+            q = -q;
+        m[j / 2] = Modes.maglut[i * 129 + q];
+    }
+}
+
+/* One load and one lookup per sample in the table indexed by the raw
+ * I/Q pair, with no subtraction, abs or multiplication. The table is
+ * 128 KiB, it is the best option on cores without a good SIMD unit. */
+static void magnitudePair(unsigned char* p, uint16_t* m, uint32_t len)
+{
+    uint32_t j;
+
+    for (j = 0; j < len; j += 2) {
+        uint16_t pair;
+
+        memcpy(&pair, p + j, 2);
+        m[j / 2] = Modes.maglut_pair[pair];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* SSE2 has no gather instruction: compute the 16 table indexes of every
+ * iteration without branches, then do the lookups one by one. */
+__attribute__((target("sse2"))) static void magnitudeSSE2(unsigned char* p, uint16_t* m, uint32_t len)
+{
+    const __m128i low = _mm_set1_epi16(0xff);
+    const __m128i zero = _mm_set1_epi16(127);
+    const __m128i row = _mm_set1_epi16(129);
+    uint16_t idx[16];
+    uint32_t j, k;
+
+    for (j = 0; j + 32 <= len; j += 32) {
+        for (k = 0; k < 2; k++) {
+            __m128i v = _mm_loadu_si128((__m128i*)(p + j + k * 16));
+            __m128i i = _mm_sub_epi16(_mm_and_si128(v, low), zero);
+            __m128i q = _mm_sub_epi16(_mm_srli_epi16(v, 8), zero);
+
+            i = _mm_max_epi16(i, _mm_sub_epi16(_mm_setzero_si128(), i));
+            q = _mm_max_epi16(q, _mm_sub_epi16(_mm_setzero_si128(), q));
+            _mm_storeu_si128((__m128i*)(idx + k * 8), _mm_add_epi16(_mm_mullo_epi16(i, row), q));
+        }
+        for (k = 0; k < 16; k++)
+            m[j / 2 + k] = Modes.maglut[idx[k]];
+    }
+    magnitudeScalar(p + j, m + j / 2, len - j);
+}
+
+/* AVX2 gathers 8 table entries at once. Entries are 16 bit wide, so we
+ * gather 32 bit words at a 2 byte scale and keep the low half: this is why
+ * Modes.maglut has two bytes of padding after the last entry. */
+__attribute__((target("avx2"))) static void magnitudeAVX2(unsigned char* p, uint16_t* m, uint32_t len)
+{
+    const __m256i low = _mm256_set1_epi16(0xff);
+    const __m256i zero = _mm256_set1_epi16(127);
+    const __m256i row = _mm256_set1_epi16(129);
+    const __m256i mask = _mm256_set1_epi32(0xffff);
+    const int* lut = (const int*)Modes.maglut;
+    uint32_t j, k;
+
+    for (j = 0; j + 64 <= len; j += 64) {
+        for (k = 0; k < 2; k++) {
+            __m256i v = _mm256_loadu_si256((__m256i*)(p + j + k * 32));
+            __m256i i = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_and_si256(v, low), zero));
+            __m256i q = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_srli_epi16(v, 8), zero));
+            __m256i idx = _mm256_add_epi16(_mm256_mullo_epi16(i, row), q);
+            __m256i lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(idx));
+            __m256i hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(idx, 1));
+
+            lo = _mm256_and_si256(_mm256_i32gather_epi32(lut, lo, 2), mask);
+            hi = _mm256_and_si256(_mm256_i32gather_epi32(lut, hi, 2), mask);
+            /* packus works on 128 bit lanes, put the quadwords back in
+             * order. */
+            _mm256_storeu_si256((__m256i*)(m + j / 2 + k * 16),
+                _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xd8));
+        }
+    }
+    magnitudeScalar(p + j, m + j / 2, len - j);
+}
+#endif
+
+#if defined(__aarch64__)
+/* NEON has no gather either, but has a fast square root. With i and q in
+ * the 0-128 range the LUT value is round(sqrt((i^2 + q^2) * 360^2)), where
+ * the argument fits in 32 bits. The single precision square root can be
+ * off by one after rounding, so the result 'r' is fixed using integer math:
+ * it is correct when r^2 - r < n <= r^2 + r. */
+static void magnitudeNEON(unsigned char* p, uint16_t* m, uint32_t len)
+{
+    const uint8x16_t zero = vdupq_n_u8(127);
+    uint32_t j, k;
+
+    for (j = 0; j + 32 <= len; j += 32) {
+        uint8x16x2_t v = vld2q_u8(p + j);
+        uint8x16_t i = vabdq_u8(v.val[0], zero);
+        uint8x16_t q = vabdq_u8(v.val[1], zero);
+        uint16x8_t sq[2];
+
+        sq[0] = vmlal_u8(vmull_u8(vget_low_u8(i), vget_low_u8(i)), vget_low_u8(q), vget_low_u8(q));
+        sq[1] = vmlal_u8(vmull_u8(vget_high_u8(i), vget_high_u8(i)), vget_high_u8(q), vget_high_u8(q));
+        for (k = 0; k < 4; k++) {
+            uint16x4_t s = (k & 1) ? vget_high_u16(sq[k / 2]) : vget_low_u16(sq[k / 2]);
+            uint32x4_t n = vmulq_n_u32(vmovl_u16(s), 360 * 360);
+            uint32x4_t r = vcvtnq_u32_f32(vsqrtq_f32(vcvtq_f32_u32(n)));
+            uint32x4_t rr = vmulq_u32(r, r);
+
+            /* Mask lanes are all ones (-1) where the condition holds. */
+            r = vsubq_u32(r, vcgtq_u32(n, vaddq_u32(rr, r)));
+            r = vaddq_u32(r, vandq_u32(vcleq_u32(vaddq_u32(n, r), rr), vtstq_u32(r, r)));
+            vst1_u16(m + j / 2 + k * 4, vmovn_u32(r));
+        }
+    }
+    magnitudeScalar(p + j, m + j / 2, len - j);
+}
+#endif
+
+static struct {
+    char* name;
+    magnitudeKernel fn;
+} magnitude_kernels[] = {
+#if defined(__aarch64__)
+    { "neon", magnitudeNEON },
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2", magnitudeAVX2 },
+    { "sse2", magnitudeSSE2 },
+#endif
+    { "pair", magnitudePair },
+    { "scalar", magnitudeScalar },
+    { NULL, NULL }
+};
+
+/* Return 1 if the CPU we are running on can execute the named kernel. */
+static int magnitudeKernelSupported(char* name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (!strcmp(name, "avx2"))
+        return __builtin_cpu_supports("avx2");
+    if (!strcmp(name, "sse2"))
+        return __builtin_cpu_supports("sse2");
+#endif
+    MODES_NOTUSED(name);
+    return 1;
+}
+
+/* Check the kernel against the lookup table for every possible I/Q pair.
+ * Returns 1 if the output is identical. */
+static int magnitudeKernelCheck(magnitudeKernel fn)
+{
+    unsigned char* p = malloc(65536 * 2);
+    uint16_t* m = malloc(65536 * 2);
+    int j, ok = 1;
+
+    for (j = 0; j < 65536; j++) {
+        p[j * 2] = j >> 8;
+        p[j * 2 + 1] = j & 0xff;
+    }
+    fn(p, m, 65536 * 2);
+    for (j = 0; j < 65536; j++) {
+        int i = abs(p[j * 2] - 127);
+        int q = abs(p[j * 2 + 1] - 127);
+
+        if (m[j] != Modes.maglut[i * 129 + q]) {
+            ok = 0;
+            break;
+        }
+    }
+    free(p);
+    free(m);
+    return ok;
+}
+
+/* Select the magnitude kernel: the one named by --magnitude, or the first
+ * one of the table the CPU supports. Must be called after Modes.maglut is
+ * populated. */
+void modesInitMagnitude(void)
+{
+    int j;
+
+    magnitude_kernel = NULL;
+    for (j = 0; magnitude_kernels[j].name; j++) {
+        char* name = magnitude_kernels[j].name;
+
+        if (Modes.magnitude_kernel && strcmp(Modes.magnitude_kernel, "auto") && strcmp(Modes.magnitude_kernel, name))
+            continue;
+        if (!magnitudeKernelSupported(name)) {
+            if (Modes.magnitude_kernel)
+                fprintf(stderr, "Magnitude kernel '%s' not supported by this CPU.\n", name);
+            continue;
+        }
+        if (!magnitudeKernelCheck(magnitude_kernels[j].fn)) {
+            fprintf(stderr, "Magnitude kernel '%s' does not match the lookup table, skipped.\n", name);
+            continue;
+        }
+        magnitude_kernel = magnitude_kernels[j].fn;
+        fprintf(stderr, "Magnitude kernel: %s\n", name);
+        break;
+    }
+    if (!magnitude_kernel) {
+        if (Modes.magnitude_kernel && strcmp(Modes.magnitude_kernel, "auto"))
+            fprintf(stderr, "Using the scalar magnitude kernel instead of '%s'.\n", Modes.magnitude_kernel);
+        magnitude_kernel = magnitudeScalar;
+    }
+}
+
+/* Turn the 'len' bytes of I/Q samples pointed by 'p' into the magnitude
+ * vector pointed by 'm'. */
+void computeMagnitudeVector(unsigned char* p, uint16_t* m, uint32_t len)
+{
+    magnitude_kernel(p, m, len);
+}
@@ -0,0 +1,9 @@
+#ifndef MAGNITUDE_H
+#define MAGNITUDE_H
+
+#include <stdint.h>
+
+void modesInitMagnitude(void);
+void computeMagnitudeVector(unsigned char*, uint16_t*, uint32_t);
+
+#endif //MAGNITUDE_H
@@ -48,7 +48,14 @@
 #include "data.h"
 #include "decode.h"
 #include "gps.h"
+#include "ifile.h"
 #include "interactive.h"
+#include "magnitude.h"
+#include "merge.h"
+#include "net.h"
+#include "preamble.h"
+#include "ring.h"
+#include "rtltcp.h"
 #include "sdr.h"
 
 struct Modes Modes;
@@ -61,36 +68,64 @@ void modesInitConfig(void)
     Modes.check_crc = 1;
     Modes.interactive = 1;
     Modes.interactive_rows = MODES_INTERACTIVE_ROWS;
+    Modes.interactive_sort = MODES_SORT_NONE;
+    Modes.net = 0;
+    Modes.net_output_sbs_port = MODES_NET_OUTPUT_SBS_PORT;
+    Modes.net_output_raw_port = MODES_NET_OUTPUT_RAW_PORT;
+    Modes.net_output_beast_port = MODES_NET_OUTPUT_BEAST_PORT;
+    Modes.net_input_raw_port = MODES_NET_INPUT_RAW_PORT;
+    Modes.net_http_port = MODES_NET_HTTP_PORT;
+    Modes.net_only = 0;
+    Modes.merge_window = MODES_MERGE_WINDOW;
     Modes.interactive_ttl = MODES_INTERACTIVE_TTL;
     Modes.aggressive = 0;
+    Modes.ring_depth = MODES_RING_DEPTH;
+    Modes.zero_copy = 0;
+    Modes.magnitude_kernel = NULL;
+    Modes.preamble_kernel = NULL;
+    Modes.demod_threads = 1;
+    Modes.aircraft_pool = MODES_AIRCRAFT_POOL_LEN;
+    Modes.aircraft_max = 0;
+    Modes.icao_cache_len = MODES_ICAO_CACHE_LEN;
+    Modes.ndevices = 0;
+    Modes.filename = NULL;
+    Modes.realtime = 0;
+    Modes.rtltcp = NULL;
     Modes.lat = 0.0;
     Modes.lon = 0.0;
+    Modes.max_range = MODES_MAX_RANGE;
 }
 
 void modesInit(void)
 {
     int i, q;
 
-    pthread_mutex_init(&Modes.data_mutex, NULL);
-    pthread_cond_init(&Modes.data_cond, NULL);
     /* We add a full message minus a final bit to the length, so that we
      * can carry the remaining part of the buffer that we can't process
      * in the message detection loop, back at the start of the next data
      * to process. This way we are able to also detect messages crossing
      * two reads. */
     Modes.data_len = MODES_DATA_LEN + (MODES_FULL_LEN - 1) * 4;
-    Modes.data_ready = 0;
-    /* Allocate the ICAO address cache. We use two uint32_t for every
-     * entry because it's a addr / timestamp pair for every entry. */
-    Modes.icao_cache = malloc(sizeof(uint32_t) * MODES_ICAO_CACHE_LEN * 2);
-    memset(Modes.icao_cache, 0, sizeof(uint32_t) * MODES_ICAO_CACHE_LEN * 2);
-    Modes.aircrafts = NULL;
+    /* Blocks are only copied in the ring when reading from the device
+     * without --zero-copy. */
+    ringInit(&Modes.ring, Modes.ring_depth,
+        (Modes.zero_copy || Modes.filename) ? 0 : Modes.data_len);
+    modesInitICAOCache();
+    modesInitAircrafts();
+    modesInitCPR();
     Modes.interactive_last_update = 0;
-    if ((Modes.data = malloc(Modes.data_len)) == NULL || (Modes.magnitude = malloc(Modes.data_len * 2)) == NULL) {
+    Modes.screen = NULL;
+    Modes.screen_frame = NULL;
+    Modes.screen_rows = 0;
+    Modes.screen_cols = 0;
+    Modes.screen_out = NULL;
+    Modes.screen_out_len = 0;
+    Modes.screen_sorted = NULL;
+    Modes.screen_sorted_len = 0;
+    if ((Modes.magnitude = malloc(Modes.data_len * 2)) == NULL) {
         fprintf(stderr, "Out of memory allocating data buffer.\n");
         exit(1);
     }
-    memset(Modes.data, 127, Modes.data_len);
 
     /* Populate the I/Q -> Magnitude lookup table. It is used because
      * sqrt or round may be expensive and may vary a lot depending on
@@ -98,14 +133,36 @@ void modesInit(void)
      *
      * We scale to 0-255 range multiplying by 1.4 in order to ensure that
      * every different I/Q pair will result in a different magnitude value,
-     * not losing any resolution. */
-    Modes.maglut = malloc(129 * 129 * 2);
+     * not losing any resolution.
+     *
+     * Two bytes of padding allow SIMD kernels to gather 32 bit words. */
+    Modes.maglut = malloc(129 * 129 * 2 + 2);
+    Modes.maglut[129 * 129] = 0;
     for (i = 0; i <= 128; i++) {
         for (q = 0; q <= 128; q++) {
             Modes.maglut[i * 129 + q] = round(sqrt(i * i + q * q) * 360);
         }
     }
 
+    /* Same values, but indexed directly by the two raw I/Q bytes as they
+     * are read from memory as a single uint16_t, so that no arithmetic is
+     * needed at all to compute a magnitude. */
+    Modes.maglut_pair = malloc(65536 * 2);
+    for (i = 0; i <= 255; i++) {
+        for (q = 0; q <= 255; q++) {
+            unsigned char pair[2] = { i, q };
+            uint16_t key;
+
+            memcpy(&key, pair, 2);
+            Modes.maglut_pair[key] = Modes.maglut[abs(i - 127) * 129 + abs(q - 127)];
+        }
+    }
+    modesInitMagnitude();
+    modesInitPreamble();
+    modesInitChecksum();
+    modesInitSyndromes();
+    modesInitDemod();
+
 
     /* Statistics */
     Modes.stat_valid_preamble = 0;
@@ -116,8 +173,15 @@ void modesInit(void)
     Modes.stat_single_bit_fix = 0;
     Modes.stat_two_bits_fix = 0;
     Modes.stat_http_requests = 0;
+    Modes.stat_http_not_modified = 0;
+    Modes.stat_http_snapshots = 0;
     Modes.stat_sbs_connections = 0;
+    Modes.stat_net_slow_clients = 0;
+    Modes.stat_net_input = 0;
+    Modes.stat_net_input_errors = 0;
     Modes.stat_out_of_phase = 0;
+    Modes.stat_samples = 0;
+    Modes.stat_rtltcp_reads = 0;
     Modes.exit = 0;
 }
 
@@ -127,7 +191,38 @@ void showHelp(void)
 {
     printf(
         "--lat <latitude>    Select the latitude of your position.\n"
-        "--lon <longitude>   Select the longitude of your position.\n");
+        "--lon <longitude>   Select the longitude of your position.\n"
+        "--max-range <km>    Discard positions farther (default: %d).\n"
+        "--device <n|serial> RTLSDR device index or serial (default: 0). Repeat to\n"
+        "                    decode up to %d devices at once.\n"
+        "--ring-depth <n>    IQ blocks queued for the decoder (default: %d).\n"
+        "--zero-copy         Decode in place from the librtlsdr buffers.\n"
+        "--ifile <filename>  Read 8 bit unsigned IQ samples from a file.\n"
+        "--realtime          Read --ifile at the device sample rate.\n"
+        "--rtl-tcp <host:p>  Read IQ samples from an rtl_tcp server (default port: %s).\n"
+        "--magnitude <name>  Magnitude kernel: auto, avx2, sse2, neon, pair, scalar.\n"
+        "--preamble <name>   Preamble prefilter: auto, avx2, sse2, neon, scalar.\n"
+        "--threads <n>       Threads demodulating every block (default: 1).\n"
+        "--aggressive        Fix two bit errors in DF11 and DF17 messages.\n"
+        "--aircraft-pool <n> Aircraft records allocated at once (default: %d).\n"
+        "--aircraft-max <n>  Max aircrafts tracked (default: 0, no limit).\n"
+        "--icao-cache <n>    ICAO address cache entries (default: %d).\n"
+        "--sort <field>      Sort aircrafts by distance, altitude or messages.\n"
+        "--quiet             Headless mode: no interactive display.\n"
+        "--net               Enable networking.\n"
+        "--net-sbs-port <p>  TCP listening port for SBS output (default: %d).\n"
+        "--net-ro-port <p>   TCP listening port for raw output (default: %d).\n"
+        "--net-bo-port <p>   TCP listening port for Beast output (default: %d).\n"
+        "--net-ri-port <p>   TCP listening port for raw / Beast input (default: %d).\n"
+        "--net-http-port <p> HTTP server port (default: %d).\n"
+        "--net-only          No IQ source, only decode the network input.\n"
+        "--merge-window <ms> Drop copies of a frame from other devices or feeders, 0\n"
+        "                    to keep them (default: %d).\n",
+        MODES_MAX_RANGE, MODES_MAX_DEVICES, MODES_RING_DEPTH, MODES_RTLTCP_PORT,
+        MODES_AIRCRAFT_POOL_LEN,
+        MODES_ICAO_CACHE_LEN, MODES_NET_OUTPUT_SBS_PORT,
+        MODES_NET_OUTPUT_RAW_PORT, MODES_NET_OUTPUT_BEAST_PORT,
+        MODES_NET_INPUT_RAW_PORT, MODES_NET_HTTP_PORT, MODES_MERGE_WINDOW);
 }
 
 /* This function is called a few times every second by main in order to
@@ -135,12 +230,78 @@ void showHelp(void)
  * from the net, refreshing the screen in interactive mode, and so forth. */
 void backgroundTasks(void)
 {
+    long long now;
+
+    if (Modes.net)
+        modesNetPoll(0);
+
+    /* In headless mode with no aircraft tracked there is nothing to do,
+     * not even reading the clock. */
+    if (!Modes.interactive && !Modes.aircraft_count)
+        return;
+
     /* Refresh screen when in interactive mode. */
-    if ((mstime() - Modes.interactive_last_update) > MODES_INTERACTIVE_REFRESH_TIME) {
+    now = mstime();
+    if ((now - Modes.interactive_last_update) > MODES_INTERACTIVE_REFRESH_TIME) {
         interactiveRemoveStaleAircrafts();
-        interactiveShowData();
-        Modes.interactive_last_update = mstime();
+        if (Modes.interactive)
+            interactiveShowData();
+        Modes.interactive_last_update = now;
+    }
+}
+
+/* Take the oldest block from the ring and compute its magnitude vector in
+ * 'm', seam included. The block is given back to the reader as soon as
+ * this is done, so that the slot (or in zero copy mode the librtlsdr
+ * buffer) can be reused while we perform the computationally expensive
+ * detection. Returns the samples in 'm', and the clocks of m[0] in
+ * 'timestamp' and 'ms', or 0 once the ring is closed and drained. */
+static uint32_t readBlock(struct iqRing* r, uint16_t* m, uint64_t* timestamp, long long* ms)
+{
+    struct iqBlock* b = ringPop(r);
+    uint32_t len;
+
+    if (!b)
+        return 0;
+    len = (MODES_FULL_LEN - 1) * 4 + b->len;
+
+    /* The seam comes before the first sample of the block. */
+    *timestamp = b->timestamp - (MODES_FULL_LEN - 1) * 2 * MODES_CLOCK_PER_SAMPLE;
+    *ms = b->ms - (MODES_FULL_LEN - 1) * 2 * 1000 / MODES_DEFAULT_RATE;
+    computeMagnitudeVector(b->seam, m, (MODES_FULL_LEN - 1) * 4);
+    computeMagnitudeVector(b->data, m + (MODES_FULL_LEN - 1) * 2, b->len);
+    ringRelease(r);
+    return len / 2;
+}
+
+/* Demodulator of a device, when there are several of them. Blocks are
+ * demodulated in parallel with the other devices, then the messages are
+ * passed to the tracker, the outputs, and the background tasks holding
+ * Modes.tracker_mutex. */
+static void* deviceDemodThreadEntryPoint(void* arg)
+{
+    struct sdrDevice* d = arg;
+    int source = -(d - Modes.devices);
+
+    while (!Modes.exit) {
+        uint64_t timestamp;
+        long long ms, goodcrc;
+        uint32_t mlen = readBlock(d->ring, d->magnitude, &timestamp, &ms);
+
+        if (!mlen)
+            break;
+        detectModeSAlone(&d->chunk, d->magnitude, mlen, timestamp, ms, source);
+
+        pthread_mutex_lock(&Modes.tracker_mutex);
+        d->stat_samples += mlen - (MODES_FULL_LEN - 1) * 2;
+        Modes.stat_samples += mlen - (MODES_FULL_LEN - 1) * 2;
+        goodcrc = Modes.stat_goodcrc;
+        demodUseChunks(&d->chunk, 1);
+        d->stat_goodcrc += Modes.stat_goodcrc - goodcrc;
+        backgroundTasks();
+        pthread_mutex_unlock(&Modes.tracker_mutex);
     }
+    return NULL;
 }
 
 int main(int argc, char** argv)
@@ -157,6 +318,77 @@ int main(int argc, char** argv)
             Modes.lat = atof(argv[++j]);
         }else if (!strcmp(argv[j],"--lon") && more) {
             Modes.lon = atof(argv[++j]);
+        }else if (!strcmp(argv[j],"--max-range") && more) {
+            Modes.max_range = atof(argv[++j]);
+        }else if (!strcmp(argv[j],"--device") && more) {
+            if (Modes.ndevices == MODES_MAX_DEVICES) {
+                fprintf(stderr, "No more than %d devices.\n", MODES_MAX_DEVICES);
+                exit(1);
+            }
+            Modes.device_names[Modes.ndevices++] = argv[++j];
+        }else if (!strcmp(argv[j],"--ring-depth") && more) {
+            Modes.ring_depth = atoi(argv[++j]);
+            if (Modes.ring_depth < 1)
+                Modes.ring_depth = 1;
+        }else if (!strcmp(argv[j],"--zero-copy")) {
+            Modes.zero_copy = 1;
+        }else if (!strcmp(argv[j],"--ifile") && more) {
+            Modes.filename = strdup(argv[++j]);
+        }else if (!strcmp(argv[j],"--realtime")) {
+            Modes.realtime = 1;
+        }else if (!strcmp(argv[j],"--rtl-tcp") && more) {
+            Modes.rtltcp = strdup(argv[++j]);
+        }else if (!strcmp(argv[j],"--magnitude") && more) {
+            Modes.magnitude_kernel = strdup(argv[++j]);
+        }else if (!strcmp(argv[j],"--preamble") && more) {
+            Modes.preamble_kernel = strdup(argv[++j]);
+        }else if (!strcmp(argv[j],"--aggressive")) {
+            Modes.aggressive = 1;
+        }else if (!strcmp(argv[j],"--threads") && more) {
+            Modes.demod_threads = atoi(argv[++j]);
+            if (Modes.demod_threads < 1)
+                Modes.demod_threads = 1;
+        }else if (!strcmp(argv[j],"--aircraft-pool") && more) {
+            Modes.aircraft_pool = atoi(argv[++j]);
+            if (Modes.aircraft_pool < 1)
+                Modes.aircraft_pool = 1;
+        }else if (!strcmp(argv[j],"--aircraft-max") && more) {
+            Modes.aircraft_max = atoi(argv[++j]);
+            if (Modes.aircraft_max < 0)
+                Modes.aircraft_max = 0;
+        }else if (!strcmp(argv[j],"--net")) {
+            Modes.net = 1;
+        }else if (!strcmp(argv[j],"--net-sbs-port") && more) {
+            Modes.net_output_sbs_port = atoi(argv[++j]);
+        }else if (!strcmp(argv[j],"--net-ro-port") && more) {
+            Modes.net_output_raw_port = atoi(argv[++j]);
+        }else if (!strcmp(argv[j],"--net-bo-port") && more) {
+            Modes.net_output_beast_port = atoi(argv[++j]);
+        }else if (!strcmp(argv[j],"--net-ri-port") && more) {
+            Modes.net_input_raw_port = atoi(argv[++j]);
+        }else if (!strcmp(argv[j],"--net-http-port") && more) {
+            Modes.net_http_port = atoi(argv[++j]);
+        }else if (!strcmp(argv[j],"--merge-window") && more) {
+            Modes.merge_window = atoi(argv[++j]);
+        }else if (!strcmp(argv[j],"--net-only")) {
+            Modes.net = 1;
+            Modes.net_only = 1;
+        }else if (!strcmp(argv[j],"--quiet") || !strcmp(argv[j],"--headless")) {
+            Modes.interactive = 0;
+        }else if (!strcmp(argv[j],"--sort") && more) {
+            j++;
+            if (!strcmp(argv[j],"distance")) {
+                Modes.interactive_sort = MODES_SORT_DISTANCE;
+            } else if (!strcmp(argv[j],"altitude")) {
+                Modes.interactive_sort = MODES_SORT_ALTITUDE;
+            } else if (!strcmp(argv[j],"messages")) {
+                Modes.interactive_sort = MODES_SORT_MESSAGES;
+            } else {
+                fprintf(stderr, "Unknown sort field '%s'.\n", argv[j]);
+                exit(1);
+            }
+        }else if (!strcmp(argv[j],"--icao-cache") && more) {
+            Modes.icao_cache_len = atoi(argv[++j]);
         }else {
             fprintf(stderr,
                 "Unknown or not enough arguments for option '%s'.\n\n",
@@ -165,38 +397,106 @@ int main(int argc, char** argv)
             exit(1);
         }
     }
+    /* Without --device the first device is used. Devices are ignored
+     * when there is no IQ to read from them. */
+    if (Modes.filename || Modes.rtltcp || Modes.net_only)
+        Modes.ndevices = 0;
+    else if (!Modes.ndevices)
+        Modes.device_names[Modes.ndevices++] = "0";
+
     /* Initialization */
     modesInit();
-    modesInitRTLSDR();
+    if (Modes.net)
+        modesInitNet();
+    if (Modes.net || Modes.ndevices > 1)
+        modesInitMerge();
+    if (Modes.net_only) {
+        /* No blocks to wait for: sleep on the sockets instead. */
+        while (!Modes.exit) {
+            modesNetPoll(MODES_INTERACTIVE_REFRESH_TIME);
+            backgroundTasks();
+        }
+        return 0;
+    }
+    if (Modes.filename) {
+        modesInitFile();
+        /* Create the thread that will feed the data from the file. */
+        pthread_create(&Modes.reader_thread, NULL, fileReaderThreadEntryPoint, NULL);
+    } else if (Modes.rtltcp) {
+        modesInitRtlTcp();
+        /* Create the thread that will receive the data from the server. */
+        pthread_create(&Modes.reader_thread, NULL, rtltcpReaderThreadEntryPoint, NULL);
+    } else {
+        modesInitRTLSDR();
+        /* Create the threads that will read the data from the devices. */
+        for (j = 0; j < Modes.ndevices; j++)
+            pthread_create(&Modes.devices[j].reader_thread, NULL, readerThreadEntryPoint, &Modes.devices[j]);
+    }
 
-    /* Create the thread that will read the data from the device. */
-    pthread_create(&Modes.reader_thread, NULL, readerThreadEntryPoint, NULL);
+    if (Modes.ndevices > 1) {
+        /* Every device has its own demodulator thread, the main thread
+         * only waits. */
+        for (j = 0; j < Modes.ndevices; j++)
+            pthread_create(&Modes.devices[j].demod_thread, NULL, deviceDemodThreadEntryPoint, &Modes.devices[j]);
+        for (j = 0; j < Modes.ndevices; j++) {
+            struct sdrDevice* d = &Modes.devices[j];
 
-    pthread_mutex_lock(&Modes.data_mutex);
-    while (1) {
-        if (!Modes.data_ready) {
-            pthread_cond_wait(&Modes.data_cond, &Modes.data_mutex);
-            continue;
+            pthread_join(d->demod_thread, NULL);
+            fprintf(stderr, "Device %d: %lld samples, %lld messages with good CRC, %lld duplicates, %u blocks dropped.\n",
+                j, d->stat_samples, d->stat_goodcrc, d->stat_duplicates, atomic_load(&d->ring->dropped));
         }
-        computeMagnitudeVector();
-
-        /* Signal to the other thread that we processed the available data
-         * and we want more (useful for --ifile). */
-        Modes.data_ready = 0;
-        pthread_cond_signal(&Modes.data_cond);
-
-        /* Process data after releasing the lock, so that the capturing
-         * thread can read data while we perform computationally expensive
-         * stuff * at the same time. (This should only be useful with very
-         * slow processors). */
-        pthread_mutex_unlock(&Modes.data_mutex);
-        detectModeS(Modes.magnitude, Modes.data_len / 2);
+        modesCloseRTLSDR();
+        return 0;
+    }
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    while (1) {
+        uint64_t timestamp;
+        long long ms;
+        uint32_t mlen = readBlock(&Modes.ring, Modes.magnitude, &timestamp, &ms);
+
+        if (!mlen)
+            break; /* End of file. */
+        Modes.stat_samples += mlen - (MODES_FULL_LEN - 1) * 2;
+        detectModeS(Modes.magnitude, mlen, timestamp, ms);
         backgroundTasks();
-        pthread_mutex_lock(&Modes.data_mutex);
         if (Modes.exit)
             break;
     }
+    gettimeofday(&end, NULL);
+
+    if (Modes.filename) {
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
 
-    rtlsdr_close(Modes.dev);
+        pthread_join(Modes.reader_thread, NULL);
+        fprintf(stderr, "%lld samples in %.3f seconds: %.2f MS/s, %lld messages with good CRC.\n",
+            Modes.stat_samples, secs, secs > 0 ? Modes.stat_samples / secs / 1e6 : 0,
+            Modes.stat_goodcrc);
+        fprintf(stderr, "%lld valid preambles, %lld demodulated, %lld bad CRC, %lld fixed (%lld single bit, %lld two bits), %lld out of phase.\n",
+            Modes.stat_valid_preamble, Modes.stat_demodulated, Modes.stat_badcrc,
+            Modes.stat_fixed, Modes.stat_single_bit_fix, Modes.stat_two_bits_fix,
+            Modes.stat_out_of_phase);
+        fprintf(stderr, "ICAO address cache: %lld hits, %lld misses, %lld evictions, %lld collisions.\n",
+            atomic_load(&Modes.stat_icao_hits), atomic_load(&Modes.stat_icao_misses),
+            atomic_load(&Modes.stat_icao_evictions), atomic_load(&Modes.stat_icao_collisions));
+        if (Modes.net) {
+            fprintf(stderr, "%lld network clients dropped for being too slow, %lld messages received, %lld duplicates.\n",
+                Modes.stat_net_slow_clients, Modes.stat_net_input, Modes.stat_merge_duplicates);
+            fprintf(stderr, "%lld HTTP requests, %lld not modified, %lld JSON snapshots.\n",
+                Modes.stat_http_requests, Modes.stat_http_not_modified, Modes.stat_http_snapshots);
+        }
+        fprintf(stderr, "%lld aircrafts peak, %lld failed allocations, %u aircraft records.\n",
+            Modes.stat_aircraft_peak, Modes.stat_aircraft_failed, Modes.aircraft_records);
+        munmap(Modes.file_data, Modes.file_len);
+    } else if (Modes.rtltcp) {
+        pthread_join(Modes.reader_thread, NULL);
+        fprintf(stderr, "%lld samples in %lld reads, %u blocks dropped, %lld messages with good CRC.\n",
+            Modes.stat_samples, Modes.stat_rtltcp_reads, atomic_load(&Modes.ring.dropped),
+            Modes.stat_goodcrc);
+        close(Modes.rtltcp_fd);
+    } else {
+        modesCloseRTLSDR();
+    }
     return 0;
 }
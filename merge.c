@@ -0,0 +1,64 @@
+#include "merge.h"
+#include "data.h"
+#include "decode.h"
+
+extern struct Modes Modes;
+
+/* ============================ Feed merging ================================ */
+
+/* When several receivers hear the same transmission, the same frame comes
+ * from every device or feeder within a short time. Frames are remembered for
+ * --merge-window milliseconds in Modes.merge_table, a set associative
+ * table indexed by the parity field of the frame, that is already a CRC
+ * of its content. A frame identical to one received from another source
+ * within the window is a duplicate, and is dropped before reaching the
+ * tracker and the outputs. The same frame from the same source is a new
+ * transmission, so it is kept. Sources are not decoded in order, a copy
+ * may be stamped before the one already remembered. */
+
+void modesInitMerge(void)
+{
+    Modes.merge_table = calloc(MODES_MERGE_TABLE_LEN, sizeof(struct mergeEntry));
+    if (!Modes.merge_table) {
+        fprintf(stderr, "Out of memory allocating the merge table.\n");
+        exit(1);
+    }
+    Modes.stat_merge_duplicates = 0;
+}
+
+/* Return 1 if the message is a duplicate of a frame recently received from
+ * another source, otherwise remember it and return 0. */
+int mergeIsDuplicate(struct modesMessage* mm)
+{
+    int len = mm->msgbits / 8;
+    uint32_t parity = mm->msg[len - 3] << 16 | mm->msg[len - 2] << 8 | mm->msg[len - 1];
+    uint32_t set = ICAOHashAddress(parity) & (MODES_MERGE_TABLE_LEN / MODES_MERGE_WAYS - 1);
+    struct mergeEntry* e = &Modes.merge_table[set * MODES_MERGE_WAYS];
+    struct mergeEntry* victim = e;
+    struct client* c = mm->source > 0 ? Modes.clients[mm->source - 1] : NULL;
+    int j;
+
+    if (c)
+        c->messages++;
+    for (j = 0; j < MODES_MERGE_WAYS; j++, e++) {
+        if (e->len == len && llabs(mm->ms - e->ms) < Modes.merge_window && !memcmp(e->msg, mm->msg, len)) {
+            if (e->source != mm->source) {
+                Modes.stat_merge_duplicates++;
+                if (c)
+                    c->duplicates++;
+                else if (Modes.ndevices > 1)
+                    Modes.devices[-mm->source].stat_duplicates++;
+                return 1;
+            }
+            victim = e; /* Retransmission: refresh the entry. */
+            break;
+        }
+        if (e->ms < victim->ms)
+            victim = e;
+    }
+    memcpy(victim->msg, mm->msg, len);
+    victim->len = len;
+    victim->source = mm->source;
+    victim->ms = mm->ms;
+    return 0;
+}
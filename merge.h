@@ -0,0 +1,9 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include "data.h"
+
+void modesInitMerge(void);
+int mergeIsDuplicate(struct modesMessage*);
+
+#endif //MERGE_H
@@ -0,0 +1,855 @@
+#include "net.h"
+#include "data.h"
+#include "decode.h"
+#include "interactive.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+extern struct Modes Modes;
+
+/* ============================== Networking ================================ */
+
+/* All the sockets are non blocking and watched by a single epoll instance,
+ * polled by the main thread after every block without waiting, so that
+ * networking never delays the decoder. Messages are formatted once in the
+ * batch buffer of their service, and at the end of the block the batch is
+ * sent to every client of the service, together with what the client did
+ * not accept yet: one system call per client per block. What a client
+ * does not accept is kept in its own buffer, and a client that lets it
+ * grow past MODES_NET_CLIENT_OUTBUF_SIZE is disconnected. */
+
+/* Listen on the TCP port of the service, on every interface. */
+static void netListen(struct netService* s)
+{
+    struct sockaddr_in sa;
+    struct epoll_event ev;
+    int on = 1;
+
+    s->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s->fd == -1) {
+        fprintf(stderr, "Error creating the %s socket: %s\n", s->descr, strerror(errno));
+        exit(1);
+    }
+    setsockopt(s->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(s->port);
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(s->fd, (struct sockaddr*)&sa, sizeof(sa)) == -1 || listen(s->fd, 511) == -1) {
+        fprintf(stderr, "Error opening the %s port %d: %s\n", s->descr, s->port, strerror(errno));
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = s->fd;
+    epoll_ctl(Modes.epfd, EPOLL_CTL_ADD, s->fd, &ev);
+}
+
+/* Create the epoll instance and open the listening ports. */
+void modesInitNet(void)
+{
+    int j;
+
+    Modes.services[MODES_NET_SERVICE_SBS].descr = "Basestation TCP output";
+    Modes.services[MODES_NET_SERVICE_SBS].port = Modes.net_output_sbs_port;
+    Modes.services[MODES_NET_SERVICE_RAW].descr = "Raw TCP output";
+    Modes.services[MODES_NET_SERVICE_RAW].port = Modes.net_output_raw_port;
+    Modes.services[MODES_NET_SERVICE_BEAST].descr = "Beast TCP output";
+    Modes.services[MODES_NET_SERVICE_BEAST].port = Modes.net_output_beast_port;
+    Modes.services[MODES_NET_SERVICE_RAW_IN].descr = "Raw TCP input";
+    Modes.services[MODES_NET_SERVICE_RAW_IN].port = Modes.net_input_raw_port;
+    Modes.services[MODES_NET_SERVICE_HTTP].descr = "HTTP server";
+    Modes.services[MODES_NET_SERVICE_HTTP].port = Modes.net_http_port;
+    Modes.client_list = NULL;
+    memset(Modes.clients, 0, sizeof(Modes.clients));
+    if ((Modes.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        fprintf(stderr, "Error creating the epoll instance: %s\n", strerror(errno));
+        exit(1);
+    }
+    for (j = 0; j < MODES_NET_SERVICES; j++) {
+        struct netService* s = &Modes.services[j];
+
+        s->len = 0;
+        s->clients = 0;
+        if ((s->buf = malloc(MODES_NET_SNDBUF_SIZE)) == NULL) {
+            fprintf(stderr, "Out of memory allocating the %s buffer.\n", s->descr);
+            exit(1);
+        }
+        netListen(s);
+    }
+    Modes.http_snapshot = NULL;
+}
+
+/* Accept every pending connection of the service. */
+static void netAccept(int service)
+{
+    struct netService* s = &Modes.services[service];
+    int fd;
+
+    while ((fd = accept(s->fd, NULL, NULL)) != -1) {
+        struct epoll_event ev;
+        struct client* c;
+        int sndbuf = MODES_NET_SNDBUF_SIZE;
+        int on = 1;
+
+        if (fd >= MODES_NET_MAX_FD || (c = malloc(sizeof(*c))) == NULL) {
+            close(fd);
+            continue;
+        }
+        /* Raw input clients only receive, output clients only send, HTTP
+         * clients do both. */
+        c->in = NULL;
+        c->out = NULL;
+        if (service != MODES_NET_SERVICE_RAW_IN)
+            c->out = malloc(MODES_NET_CLIENT_OUTBUF_SIZE);
+        if (service == MODES_NET_SERVICE_RAW_IN || service == MODES_NET_SERVICE_HTTP)
+            c->in = malloc(MODES_NET_INPUT_BUF_SIZE);
+        if ((service != MODES_NET_SERVICE_RAW_IN && !c->out)
+            || ((service == MODES_NET_SERVICE_RAW_IN || service == MODES_NET_SERVICE_HTTP) && !c->in)) {
+            free(c->out);
+            free(c->in);
+            free(c);
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        c->fd = fd;
+        c->service = service;
+        c->outpos = 0;
+        c->outlen = 0;
+        c->events = EPOLLIN;
+        c->snapshot = NULL;
+        c->snappos = 0;
+        c->snaplen = 0;
+        c->inhead = 0;
+        c->intail = 0;
+        c->messages = 0;
+        c->duplicates = 0;
+        c->closing = 0;
+        c->next = Modes.client_list;
+        Modes.client_list = c;
+        Modes.clients[fd] = c;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(Modes.epfd, EPOLL_CTL_ADD, fd, &ev);
+        s->clients++;
+        if (service == MODES_NET_SERVICE_SBS)
+            Modes.stat_sbs_connections++;
+        if (Modes.debug & MODES_DEBUG_NET)
+            fprintf(stderr, "Created new %s client %d\n", s->descr, fd);
+    }
+}
+
+/* Drop a reference to the snapshot, freeing it with the last one. */
+static void httpRelease(struct httpSnapshot* s)
+{
+    if (--s->refs == 0) {
+        free(s->buf);
+        free(s);
+    }
+}
+
+/* Close the connection and free the client. It is only unlinked from
+ * Modes.client_list by modesNetFlush(), so it can be called while the list is
+ * being walked: here the client is just marked as closed. */
+static void netFreeClient(struct client* c)
+{
+    if (c->fd == -1)
+        return;
+    if (Modes.debug & MODES_DEBUG_NET)
+        fprintf(stderr, "Closing %s client %d: %lld messages, %lld duplicates\n",
+            Modes.services[c->service].descr, c->fd, c->messages, c->duplicates);
+    else if (c->service == MODES_NET_SERVICE_RAW_IN && !Modes.interactive)
+        /* Without the screen, this is where the feeder counters are seen. */
+        fprintf(stderr, "Feeder %d disconnected: %lld messages, %lld duplicates (%.1f%%).\n",
+            c->fd, c->messages, c->duplicates,
+            c->messages ? 100.0 * c->duplicates / c->messages : 0.0);
+    Modes.clients[c->fd] = NULL;
+    close(c->fd); /* Also removes it from the epoll set. */
+    c->fd = -1;
+    Modes.services[c->service].clients--;
+    if (c->snapshot) {
+        httpRelease(c->snapshot);
+        c->snapshot = NULL;
+    }
+    if (c->service == MODES_NET_SERVICE_SBS)
+        Modes.stat_sbs_connections--;
+}
+
+/* Send the pending output of the client, the rest of the snapshot it is
+ * sending, then 'len' bytes of 'buf', with a single system call. What the
+ * kernel does not accept is kept in the client buffer, or for the snapshot
+ * just sent later from where it stopped, and the socket is watched for
+ * becoming writable again. A client whose unsent data would not fit in the
+ * buffer is too slow to follow: it is disconnected. An HTTP client gets
+ * no other output while sending a snapshot, so the snapshot can never be
+ * left behind 'buf'. */
+static void netWriteClient(struct client* c, const char* buf, size_t len)
+{
+    struct iovec iov[3];
+    struct msghdr msg;
+    size_t pending = c->outlen - c->outpos;
+    size_t snap = c->snapshot ? c->snaplen - c->snappos : 0;
+    uint32_t events;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    if (pending) {
+        iov[msg.msg_iovlen].iov_base = c->out + c->outpos;
+        iov[msg.msg_iovlen++].iov_len = pending;
+    }
+    if (snap) {
+        iov[msg.msg_iovlen].iov_base = c->snapshot->response + c->snappos;
+        iov[msg.msg_iovlen++].iov_len = snap;
+    }
+    if (len) {
+        iov[msg.msg_iovlen].iov_base = (void*)buf;
+        iov[msg.msg_iovlen++].iov_len = len;
+    }
+    if (!msg.msg_iovlen)
+        return;
+    /* sendmsg() is writev() with MSG_NOSIGNAL, so that a closed
+     * connection does not raise SIGPIPE. */
+    do {
+        n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            netFreeClient(c);
+            return;
+        }
+        n = 0;
+    }
+
+    /* Consume the pending output first, then the snapshot, then keep the
+     * unsent part of 'buf'. */
+    if ((size_t)n >= pending) {
+        n -= pending;
+        c->outpos = c->outlen = 0;
+        if ((size_t)n >= snap) {
+            n -= snap;
+            if (c->snapshot) {
+                httpRelease(c->snapshot);
+                c->snapshot = NULL;
+            }
+            buf += n;
+            len -= n;
+        } else {
+            c->snappos += n;
+        }
+    } else {
+        c->outpos += n;
+    }
+    if (len) {
+        if (c->outlen + len > MODES_NET_CLIENT_OUTBUF_SIZE && c->outpos) {
+            memmove(c->out, c->out + c->outpos, c->outlen - c->outpos);
+            c->outlen -= c->outpos;
+            c->outpos = 0;
+        }
+        if (c->outlen + len > MODES_NET_CLIENT_OUTBUF_SIZE) {
+            Modes.stat_net_slow_clients++;
+            netFreeClient(c);
+            return;
+        }
+        memcpy(c->out + c->outlen, buf, len);
+        c->outlen += len;
+    }
+    if (c->closing && !c->outlen && !c->snapshot) {
+        netFreeClient(c);
+        return;
+    }
+
+    /* The next requests wait in the input ring while a snapshot is sent. */
+    events = c->snapshot ? EPOLLOUT : EPOLLIN | (c->outlen ? EPOLLOUT : 0);
+    if (events != c->events) {
+        struct epoll_event ev;
+
+        c->events = events;
+        ev.events = events;
+        ev.data.fd = c->fd;
+        epoll_ctl(Modes.epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+}
+
+/* Send the batched output of every service to its clients, and release
+ * the clients closed since the last flush. */
+void modesNetFlush(void)
+{
+    struct client** pc = &Modes.client_list;
+    int j;
+
+    while (*pc) {
+        struct client* c = *pc;
+
+        /* What is already pending is sent on EPOLLOUT. */
+        if (c->fd != -1 && Modes.services[c->service].len) {
+            struct netService* s = &Modes.services[c->service];
+
+            netWriteClient(c, s->buf, s->len);
+        }
+        if (c->fd == -1) {
+            *pc = c->next;
+            free(c->out);
+            free(c->in);
+            free(c);
+        } else {
+            pc = &c->next;
+        }
+    }
+    for (j = 0; j < MODES_NET_SERVICES; j++)
+        Modes.services[j].len = 0;
+}
+
+/* Add 'len' bytes to the batch of the service, flushing first if the
+ * batch is full. Nothing is batched when nobody is connected. */
+void modesNetQueue(int service, const char* buf, size_t len)
+{
+    struct netService* s = &Modes.services[service];
+
+    if (!s->clients)
+        return;
+    if (s->len + len > MODES_NET_SNDBUF_SIZE)
+        modesNetFlush();
+    memcpy(s->buf + s->len, buf, len);
+    s->len += len;
+}
+
+/* Input clients send AVR ("*8D...;", or "@" followed by a 48 bit
+ * timestamp and the message) or Beast binary frames, possibly mixed. The
+ * socket is read straight into the ring of the client, and frames are
+ * parsed in place: only the message bytes are extracted, so nothing is
+ * copied but the 7 or 14 bytes handed to decodeModesMessage(). */
+
+/* Return the byte 'k' positions after the tail of the input ring. */
+#define NET_IN(c, k) ((c)->in[((c)->intail + (k)) & (MODES_NET_INPUT_BUF_SIZE - 1)])
+
+/* Return the value of an hex digit, or -1. */
+static int netHexDigit(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* Decode a message received from the network and pass it to the next
+ * layer, like the demodulator does. */
+static void netUseMessage(struct client* c, unsigned char* msg, uint64_t timestamp, int signal, long long ms)
+{
+    struct modesMessage mm;
+
+    mm.offset = 0;
+    mm.source = c->fd + 1;
+    mm.timestamp = timestamp;
+    mm.signal = signal;
+    mm.ms = ms;
+    mm.phase_corrected = 0;
+    decodeModesMessage(&mm, msg);
+    Modes.stat_net_input++;
+    useModesMessage(&mm);
+}
+
+/* Parse the AVR frame at the tail of the ring. Returns the frame length,
+ * 0 if the frame is not complete yet, -1 if it is not a valid frame. */
+static int netParseAVR(struct client* c, uint32_t avail, long long ms)
+{
+    unsigned char msg[MODES_LONG_MSG_BYTES];
+    uint64_t timestamp = 0;
+    uint32_t k = 1, digits = 0;
+    int d;
+
+    if (NET_IN(c, 0) == '@') {
+        for (; k < 13; k++) {
+            if (k >= avail)
+                return 0;
+            if ((d = netHexDigit(NET_IN(c, k))) == -1)
+                return -1;
+            timestamp = timestamp << 4 | d;
+        }
+    }
+    memset(msg, 0, sizeof(msg));
+    for (; k < avail; k++) {
+        int ch = NET_IN(c, k);
+
+        if (ch == ';') {
+            if (digits != MODES_SHORT_MSG_BYTES * 2 && digits != MODES_LONG_MSG_BYTES * 2)
+                return -1;
+            netUseMessage(c, msg, timestamp, 0, ms);
+            return k + 1;
+        }
+        if ((d = netHexDigit(ch)) == -1 || digits == MODES_LONG_MSG_BYTES * 2)
+            return -1;
+        msg[digits / 2] |= d << (digits & 1 ? 0 : 4);
+        digits++;
+    }
+    return 0;
+}
+
+/* Parse the Beast frame at the tail of the ring. Returns the frame length,
+ * 0 if the frame is not complete yet, -1 if it is not a valid frame. */
+static int netParseBeast(struct client* c, uint32_t avail, long long ms)
+{
+    unsigned char frame[6 + 1 + MODES_LONG_MSG_BYTES];
+    uint32_t k = 2, len, j = 0;
+    uint64_t timestamp = 0;
+
+    if (avail < 2)
+        return 0;
+    switch (NET_IN(c, 1)) {
+    case '1': len = 2; break; /* Mode A/C, skipped. */
+    case '2': len = MODES_SHORT_MSG_BYTES; break;
+    case '3': len = MODES_LONG_MSG_BYTES; break;
+    default: return -1;
+    }
+    len += 7;
+    while (j < len) {
+        if (k >= avail)
+            return 0;
+        if ((frame[j++] = NET_IN(c, k++)) == 0x1a) {
+            if (k >= avail)
+                return 0;
+            /* A single 0x1a starts a new frame: this one is broken. */
+            if (NET_IN(c, k++) != 0x1a)
+                return -1;
+        }
+    }
+    if (len > 9) {
+        for (j = 0; j < 6; j++)
+            timestamp = timestamp << 8 | frame[j];
+        netUseMessage(c, frame + 7, timestamp, frame[6], ms);
+    }
+    return k;
+}
+
+/* Parse every complete frame in the input ring of the client. */
+static void netParseInput(struct client* c, long long ms)
+{
+    while (c->inhead != c->intail) {
+        uint32_t avail = c->inhead - c->intail;
+        int ch = NET_IN(c, 0);
+        int n;
+
+        if (ch == '*' || ch == '@')
+            n = netParseAVR(c, avail, ms);
+        else if (ch == 0x1a)
+            n = netParseBeast(c, avail, ms);
+        else
+            n = -1; /* Newlines, or garbage. */
+        if (n == 0)
+            break;
+        if (n == -1) {
+            if (ch != '\n' && ch != '\r')
+                Modes.stat_net_input_errors++;
+            n = 1; /* Resync on the next byte. */
+        }
+        c->intail += n;
+    }
+    /* A full ring without a complete frame can only be garbage. */
+    if (c->inhead - c->intail == MODES_NET_INPUT_BUF_SIZE) {
+        Modes.stat_net_input_errors += MODES_NET_INPUT_BUF_SIZE;
+        c->intail = c->inhead;
+    }
+}
+
+/* The HTTP server answers GET /data/aircraft.json with the aircrafts being
+ * tracked. Dashboards poll it from many browsers, so the response is
+ * serialized at most once every MODES_INTERACTIVE_REFRESH_TIME
+ * milliseconds, header included, and every request of the interval gets
+ * the same bytes with a single write. The ETag is a hash of the body:
+ * a client sending it back in If-None-Match gets a 304 until the body
+ * changes. */
+
+/* Append to the JSON body at '*len' in the snapshot, growing it as
+ * needed. */
+static void httpPrintf(struct httpSnapshot* s, size_t* len, const char* fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    while (1) {
+        va_start(ap, fmt);
+        n = vsnprintf(s->buf + *len, s->size - *len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (*len + n < s->size)
+            break;
+        s->size *= 2;
+        if ((s->buf = realloc(s->buf, s->size)) == NULL) {
+            fprintf(stderr, "Out of memory growing the HTTP buffer.\n");
+            exit(1);
+        }
+    }
+    *len += n;
+}
+
+/* Serialize the aircrafts in Modes.http_snapshot, after the room left for
+ * the header, then write the header just before the body. The buffer of
+ * the previous snapshot is reused unless clients are still sending it. */
+static void httpBuildSnapshot(long long now)
+{
+    struct httpSnapshot* s = Modes.http_snapshot;
+    size_t len = MODES_HTTP_HEADER_SIZE, body, j;
+    uint64_t hash = 0xcbf29ce484222325ULL; /* FNV-1a */
+    char header[MODES_HTTP_HEADER_SIZE];
+    struct aircraft* a;
+    int hlen, first = 1;
+
+    if (!s || s->refs > 1) {
+        size_t size = s ? s->size : MODES_NET_SNDBUF_SIZE;
+
+        if (s)
+            httpRelease(s);
+        if ((s = malloc(sizeof(*s))) == NULL || (s->buf = malloc(size)) == NULL) {
+            fprintf(stderr, "Out of memory allocating the HTTP buffer.\n");
+            exit(1);
+        }
+        s->refs = 1;
+        s->size = size;
+        Modes.http_snapshot = s;
+    }
+    httpPrintf(s, &len, "{\"aircraft\":[");
+    for (a = Modes.aircrafts; a; a = a->next) {
+        int flen = strlen(a->flight);
+
+        while (flen && a->flight[flen - 1] == ' ')
+            flen--;
+        httpPrintf(s, &len, "%s\n{\"hex\":\"%s\"", first ? "" : ",", a->hexaddr);
+        if (flen)
+            httpPrintf(s, &len, ",\"flight\":\"%.*s\"", flen, a->flight);
+        httpPrintf(s, &len, ",\"altitude\":%d,\"speed\":%d,\"track\":%d",
+            a->altitude, a->speed, a->track);
+        if (a->position_time)
+            httpPrintf(s, &len, ",\"lat\":%.6f,\"lon\":%.6f", a->lat, a->lon);
+        httpPrintf(s, &len, ",\"seen\":%d,\"messages\":%ld}",
+            (int)(now / 1000 - a->seen), a->messages);
+        first = 0;
+    }
+    httpPrintf(s, &len, "\n]}\n");
+
+    body = len - MODES_HTTP_HEADER_SIZE;
+    for (j = MODES_HTTP_HEADER_SIZE; j < len; j++)
+        hash = (hash ^ (unsigned char)s->buf[j]) * 0x100000001b3ULL;
+    snprintf(s->etag, sizeof(s->etag), "\"%016llx\"", (unsigned long long)hash);
+    hlen = snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: %zu\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "ETag: %s\r\n"
+        "\r\n",
+        body, s->etag);
+    s->response = s->buf + MODES_HTTP_HEADER_SIZE - hlen;
+    memcpy(s->response, header, hlen);
+    s->len = hlen + body;
+    s->header_len = hlen;
+    s->time = now;
+    Modes.stat_http_snapshots++;
+}
+
+/* Return the value of the header 'name' in the request, or NULL. */
+static const char* httpHeader(const char* req, const char* name)
+{
+    size_t len = strlen(name);
+    const char* p = req;
+
+    while ((p = strstr(p, "\r\n")) != NULL) {
+        p += 2;
+        if (!strncasecmp(p, name, len) && p[len] == ':') {
+            p += len + 1;
+            while (*p == ' ' || *p == '\t')
+                p++;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* Answer the request, a nul terminated request line and headers. */
+static void httpHandleRequest(struct client* c, const char* req, long long now)
+{
+    static const char notfound[] =
+        "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    static const char badmethod[] =
+        "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD\r\nContent-Length: 0\r\n\r\n";
+    static const char url[] = "/data/aircraft.json";
+    const char *p, *conn = httpHeader(req, "Connection");
+    int head = !strncmp(req, "HEAD ", 5);
+    struct httpSnapshot* s;
+    char reply[MODES_HTTP_HEADER_SIZE];
+    int len;
+
+    Modes.stat_http_requests++;
+    /* HTTP/1.1 keeps the connection open unless told otherwise, 1.0
+     * closes it unless asked to keep it. */
+    p = strstr(req, "\r\n");
+    if (conn && !strncasecmp(conn, "close", 5))
+        c->closing = 1;
+    else if (!conn || strncasecmp(conn, "keep-alive", 10))
+        c->closing = p - req >= 8 && !strncmp(p - 8, "HTTP/1.0", 8);
+
+    if (!head && strncmp(req, "GET ", 4)) {
+        c->closing = 1;
+        netWriteClient(c, badmethod, sizeof(badmethod) - 1);
+        return;
+    }
+    p = req + (head ? 5 : 4);
+    if (strncmp(p, url, sizeof(url) - 1) || (p[sizeof(url) - 1] != ' ' && p[sizeof(url) - 1] != '?')) {
+        netWriteClient(c, notfound, sizeof(notfound) - 1);
+        return;
+    }
+
+    if (!Modes.http_snapshot || now - Modes.http_snapshot->time >= MODES_INTERACTIVE_REFRESH_TIME)
+        httpBuildSnapshot(now);
+    s = Modes.http_snapshot;
+    p = httpHeader(req, "If-None-Match");
+    if (p && !strncmp(p, s->etag, strlen(s->etag))) {
+        Modes.stat_http_not_modified++;
+        len = snprintf(reply, sizeof(reply),
+            "HTTP/1.1 304 Not Modified\r\n"
+            "Cache-Control: no-cache\r\n"
+            "ETag: %s\r\n"
+            "\r\n",
+            s->etag);
+        netWriteClient(c, reply, len);
+        return;
+    }
+    /* The snapshot can be larger than the client buffer: it is sent from
+     * where it is, until done. */
+    c->snapshot = s;
+    c->snappos = 0;
+    c->snaplen = head ? s->header_len : s->len;
+    s->refs++;
+    netWriteClient(c, NULL, 0);
+}
+
+/* Answer every complete request in the input ring of the client. The
+ * request line and headers are copied out of the ring to be parsed as a
+ * string; a request body is not expected, GET and HEAD have none. */
+static void netParseHTTP(struct client* c, long long ms)
+{
+    char req[MODES_NET_INPUT_BUF_SIZE + 1];
+
+    while (c->fd != -1 && !c->closing && !c->snapshot) {
+        uint32_t avail = c->inhead - c->intail;
+        uint32_t k;
+
+        for (k = 3; k < avail; k++) {
+            if (NET_IN(c, k) == '\n' && NET_IN(c, k - 1) == '\r'
+                && NET_IN(c, k - 2) == '\n' && NET_IN(c, k - 3) == '\r')
+                break;
+        }
+        if (k >= avail) {
+            /* Headers filling the whole ring: give up on the client. */
+            if (avail == MODES_NET_INPUT_BUF_SIZE)
+                netFreeClient(c);
+            return;
+        }
+        for (avail = 0; avail <= k; avail++)
+            req[avail] = NET_IN(c, avail);
+        req[avail] = '\0';
+        c->intail += avail;
+        httpHandleRequest(c, req, ms);
+    }
+}
+
+/* Read what the client sent. Input clients get their frames parsed and
+ * HTTP clients their requests answered. The other services ignore it, but
+ * reading is how we notice the client closed the connection. */
+static void netReadClient(struct client* c)
+{
+    char buf[MODES_CLIENT_BUF_SIZE];
+    long long ms = c->in ? mstime() : 0;
+
+    while (1) {
+        ssize_t n;
+
+        if (c->in) {
+            /* Receive in the free space of the ring, up to its end. */
+            uint32_t head = c->inhead & (MODES_NET_INPUT_BUF_SIZE - 1);
+            uint32_t room = MODES_NET_INPUT_BUF_SIZE - (c->inhead - c->intail);
+
+            if (room > MODES_NET_INPUT_BUF_SIZE - head)
+                room = MODES_NET_INPUT_BUF_SIZE - head;
+            n = recv(c->fd, c->in + head, room, 0);
+            if (n > 0) {
+                c->inhead += n;
+                if (c->service == MODES_NET_SERVICE_HTTP)
+                    netParseHTTP(c, ms);
+                else
+                    netParseInput(c, ms);
+                if (c->fd == -1 || c->closing || c->snapshot)
+                    return;
+                continue;
+            }
+        } else {
+            n = recv(c->fd, buf, sizeof(buf), 0);
+            if (n > 0)
+                continue;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            netFreeClient(c);
+        return;
+    }
+}
+
+/* Handle the pending socket events, then flush. Called by the main thread
+ * after every block with a zero 'timeout', so that it never waits. With
+ * --net-only it waits up to 'timeout' milliseconds for the first event. */
+void modesNetPoll(int timeout)
+{
+    struct epoll_event events[MODES_NET_EVENTS];
+    int n, j, k;
+
+    while ((n = epoll_wait(Modes.epfd, events, MODES_NET_EVENTS, timeout)) > 0) {
+        timeout = 0;
+        for (j = 0; j < n; j++) {
+            int fd = events[j].data.fd;
+            struct client* c = fd < MODES_NET_MAX_FD ? Modes.clients[fd] : NULL;
+
+            if (!c) {
+                for (k = 0; k < MODES_NET_SERVICES; k++) {
+                    if (Modes.services[k].fd == fd)
+                        netAccept(k);
+                }
+                continue;
+            }
+            if (events[j].events & (EPOLLERR | EPOLLHUP)) {
+                netFreeClient(c);
+                continue;
+            }
+            if (events[j].events & EPOLLIN)
+                netReadClient(c);
+            if (c->fd != -1 && (events[j].events & EPOLLOUT)) {
+                netWriteClient(c, NULL, 0);
+                /* Answer the requests received while sending a snapshot. */
+                if (c->fd != -1 && c->service == MODES_NET_SERVICE_HTTP && !c->snapshot)
+                    netParseHTTP(c, mstime());
+            }
+        }
+        if (n < MODES_NET_EVENTS)
+            break;
+    }
+    modesNetFlush();
+}
+
+/* Write SBS output to TCP clients, in the BaseStation port 30003 format. */
+void modesSendSBSOutput(struct modesMessage* mm, struct aircraft* a)
+{
+    char msg[256], *p = msg;
+    int emergency = 0, ground = 0, alert = 0, spi = 0;
+
+    if (!Modes.services[MODES_NET_SERVICE_SBS].clients)
+        return;
+
+    if (mm->msgtype == 4 || mm->msgtype == 5 || mm->msgtype == 21) {
+        /* Squawk 7500 is hijack, 7600 radio failure, 7700 emergency. */
+        if (mm->identity == 7500 || mm->identity == 7600 || mm->identity == 7700)
+            emergency = -1;
+        if (mm->fs == 1 || mm->fs == 3)
+            ground = -1;
+        if (mm->fs == 2 || mm->fs == 3 || mm->fs == 4)
+            alert = -1;
+        if (mm->fs == 4 || mm->fs == 5)
+            spi = -1;
+    }
+
+    if (mm->msgtype == 0) {
+        p += sprintf(p, "MSG,5,,,%02X%02X%02X,,,,,,,%d,,,,,,,,,,",
+            mm->aa1, mm->aa2, mm->aa3, mm->altitude);
+    } else if (mm->msgtype == 4) {
+        p += sprintf(p, "MSG,5,,,%02X%02X%02X,,,,,,,%d,,,,,,,%d,%d,%d,%d",
+            mm->aa1, mm->aa2, mm->aa3, mm->altitude, alert, emergency, spi, ground);
+    } else if (mm->msgtype == 5) {
+        p += sprintf(p, "MSG,6,,,%02X%02X%02X,,,,,,,,,,,,,%d,%d,%d,%d,%d",
+            mm->aa1, mm->aa2, mm->aa3, mm->identity, alert, emergency, spi, ground);
+    } else if (mm->msgtype == 11) {
+        p += sprintf(p, "MSG,8,,,%02X%02X%02X,,,,,,,,,,,,,,,,,",
+            mm->aa1, mm->aa2, mm->aa3);
+    } else if (mm->msgtype == 17 && mm->metype == 4) {
+        p += sprintf(p, "MSG,1,,,%02X%02X%02X,,,,,,%s,,,,,,,,0,0,0,0",
+            mm->aa1, mm->aa2, mm->aa3, mm->flight);
+    } else if (mm->msgtype == 17 && mm->metype >= 9 && mm->metype <= 18) {
+        if (!a || !a->position_time) {
+            p += sprintf(p, "MSG,3,,,%02X%02X%02X,,,,,,,%d,,,,,,,0,0,0,0",
+                mm->aa1, mm->aa2, mm->aa3, mm->altitude);
+        } else {
+            p += sprintf(p, "MSG,3,,,%02X%02X%02X,,,,,,,%d,,,%1.5f,%1.5f,,,0,0,0,0",
+                mm->aa1, mm->aa2, mm->aa3, mm->altitude, a->lat, a->lon);
+        }
+    } else if (mm->msgtype == 17 && mm->metype == 19 && mm->mesub == 1) {
+        int vr = (mm->vert_rate_sign == 0 ? 1 : -1) * (mm->vert_rate - 1) * 64;
+
+        p += sprintf(p, "MSG,4,,,%02X%02X%02X,,,,,,,,%d,%d,,,%i,,0,0,0,0",
+            mm->aa1, mm->aa2, mm->aa3, mm->velocity, mm->heading, vr);
+    } else if (mm->msgtype == 21) {
+        p += sprintf(p, "MSG,6,,,%02X%02X%02X,,,,,,,,,,,,,%d,%d,%d,%d,%d",
+            mm->aa1, mm->aa2, mm->aa3, mm->identity, alert, emergency, spi, ground);
+    } else {
+        return;
+    }
+    *p++ = '\n';
+    modesNetQueue(MODES_NET_SERVICE_SBS, msg, p - msg);
+}
+
+/* Write raw output to TCP clients, in the AVR format: '*', the message in
+ * hex, ';' and a newline. */
+void modesSendRawOutput(struct modesMessage* mm)
+{
+    char msg[MODES_LONG_MSG_BYTES * 2 + 3], *p = msg;
+    int j;
+
+    if (!Modes.services[MODES_NET_SERVICE_RAW].clients)
+        return;
+    *p++ = '*';
+    for (j = 0; j < mm->msgbits / 8; j++) {
+        *p++ = "0123456789ABCDEF"[mm->msg[j] >> 4];
+        *p++ = "0123456789ABCDEF"[mm->msg[j] & 15];
+    }
+    *p++ = ';';
+    *p++ = '\n';
+    modesNetQueue(MODES_NET_SERVICE_RAW, msg, p - msg);
+}
+
+/* Write Beast binary output to TCP clients: 0x1a, '2' or '3' for short or
+ * long messages, the 12 MHz timestamp in 6 bytes big endian, the signal
+ * level in a byte, then the message. A 0x1a byte after the type is sent
+ * twice. */
+void modesSendBeastOutput(struct modesMessage* mm)
+{
+    unsigned char raw[6 + 1 + MODES_LONG_MSG_BYTES];
+    char msg[2 + sizeof(raw) * 2], *p = msg;
+    int len = mm->msgbits / 8;
+    int j;
+
+    if (!Modes.services[MODES_NET_SERVICE_BEAST].clients)
+        return;
+    for (j = 0; j < 6; j++)
+        raw[j] = mm->timestamp >> (40 - j * 8);
+    raw[6] = mm->signal;
+    memcpy(raw + 7, mm->msg, len);
+
+    *p++ = 0x1a;
+    *p++ = len == MODES_SHORT_MSG_BYTES ? '2' : '3';
+    for (j = 0; j < 7 + len; j++) {
+        *p++ = raw[j];
+        if (raw[j] == 0x1a)
+            *p++ = 0x1a;
+    }
+    modesNetQueue(MODES_NET_SERVICE_BEAST, msg, p - msg);
+}
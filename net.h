@@ -0,0 +1,14 @@
+#ifndef NET_H
+#define NET_H
+
+#include "data.h"
+
+void modesInitNet(void);
+void modesNetPoll(int);
+void modesNetFlush(void);
+void modesNetQueue(int, const char*, size_t);
+void modesSendSBSOutput(struct modesMessage*, struct aircraft*);
+void modesSendRawOutput(struct modesMessage*);
+void modesSendBeastOutput(struct modesMessage*);
+
+#endif //NET_H
@@ -0,0 +1,210 @@
+#include "preamble.h"
+#include "data.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+extern struct Modes Modes;
+
+/* ============================ Preamble prefilter ========================== */
+
+/* Most of the magnitude buffer is just noise, and most offsets are rejected
+ * by the first test detectModeS() does, the relations between the first 10
+ * samples of a valid preamble. The prefilter evaluates this test for
+ * MODES_PREAMBLE_BATCH consecutive offsets at once and returns a bitmask
+ * where bit 'k' is set if the test passes at offset 'k', so that the rest
+ * of the detection only runs on these offsets.
+ *
+ * Every kernel reads m[0] to m[MODES_PREAMBLE_BATCH + 9]. */
+typedef uint32_t (*preambleKernel)(uint16_t*);
+
+/* Kernel selected by modesInitPreamble(). */
+static preambleKernel preamble_kernel;
+
+/* Reference implementation, the same test detectModeS() does. */
+static uint32_t preambleScalar(uint16_t* m)
+{
+    uint32_t mask = 0;
+    int j;
+
+    for (j = 0; j < MODES_PREAMBLE_BATCH; j++) {
+        if (m[j] > m[j + 1] && m[j + 1] < m[j + 2] && m[j + 2] > m[j + 3] && m[j + 3] < m[j] && m[j + 4] < m[j] && m[j + 5] < m[j] && m[j + 6] < m[j] && m[j + 7] > m[j + 8] && m[j + 8] < m[j + 9] && m[j + 9] > m[j + 6])
+            mask |= 1 << j;
+    }
+    return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Magnitudes use the full 16 bit range but SSE2 and AVX2 only have signed
+ * 16 bit comparisons: flipping the sign bit of both operands turns them
+ * into unsigned comparisons. */
+__attribute__((target("sse2"))) static uint32_t preambleSSE2(uint16_t* m)
+{
+    const __m128i sign = _mm_set1_epi16((short)0x8000);
+    uint32_t mask = 0;
+    int j, k;
+
+    for (j = 0; j < MODES_PREAMBLE_BATCH; j += 8) {
+        __m128i s[10], c;
+
+        for (k = 0; k < 10; k++)
+            s[k] = _mm_xor_si128(_mm_loadu_si128((__m128i*)(m + j + k)), sign);
+        c = _mm_and_si128(_mm_cmpgt_epi16(s[0], s[1]), _mm_cmpgt_epi16(s[2], s[1]));
+        c = _mm_and_si128(c, _mm_cmpgt_epi16(s[2], s[3]));
+        c = _mm_and_si128(c, _mm_cmpgt_epi16(s[0], s[3]));
+        c = _mm_and_si128(c, _mm_cmpgt_epi16(s[0], s[4]));
+        c = _mm_and_si128(c, _mm_cmpgt_epi16(s[0], s[5]));
+        c = _mm_and_si128(c, _mm_cmpgt_epi16(s[0], s[6]));
+        c = _mm_and_si128(c, _mm_cmpgt_epi16(s[7], s[8]));
+        c = _mm_and_si128(c, _mm_cmpgt_epi16(s[9], s[8]));
+        c = _mm_and_si128(c, _mm_cmpgt_epi16(s[9], s[6]));
+        mask |= (_mm_movemask_epi8(_mm_packs_epi16(c, c)) & 0xff) << j;
+    }
+    return mask;
+}
+
+__attribute__((target("avx2"))) static uint32_t preambleAVX2(uint16_t* m)
+{
+    const __m256i sign = _mm256_set1_epi16((short)0x8000);
+    __m256i s[10], c;
+    int k;
+
+    for (k = 0; k < 10; k++)
+        s[k] = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(m + k)), sign);
+    c = _mm256_and_si256(_mm256_cmpgt_epi16(s[0], s[1]), _mm256_cmpgt_epi16(s[2], s[1]));
+    c = _mm256_and_si256(c, _mm256_cmpgt_epi16(s[2], s[3]));
+    c = _mm256_and_si256(c, _mm256_cmpgt_epi16(s[0], s[3]));
+    c = _mm256_and_si256(c, _mm256_cmpgt_epi16(s[0], s[4]));
+    c = _mm256_and_si256(c, _mm256_cmpgt_epi16(s[0], s[5]));
+    c = _mm256_and_si256(c, _mm256_cmpgt_epi16(s[0], s[6]));
+    c = _mm256_and_si256(c, _mm256_cmpgt_epi16(s[7], s[8]));
+    c = _mm256_and_si256(c, _mm256_cmpgt_epi16(s[9], s[8]));
+    c = _mm256_and_si256(c, _mm256_cmpgt_epi16(s[9], s[6]));
+    /* Pack to bytes, packs works on 128 bit lanes so put the offsets back
+     * in order before extracting the mask. */
+    c = _mm256_permute4x64_epi64(_mm256_packs_epi16(c, c), 0xd8);
+    return _mm256_movemask_epi8(c) & 0xffff;
+}
+#endif
+
+#if defined(__aarch64__)
+static uint32_t preambleNEON(uint16_t* m)
+{
+    static const uint16_t bit[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint16x8_t bits = vld1q_u16(bit);
+    uint32_t mask = 0;
+    int j, k;
+
+    for (j = 0; j < MODES_PREAMBLE_BATCH; j += 8) {
+        uint16x8_t s[10], c;
+
+        for (k = 0; k < 10; k++)
+            s[k] = vld1q_u16(m + j + k);
+        c = vandq_u16(vcgtq_u16(s[0], s[1]), vcgtq_u16(s[2], s[1]));
+        c = vandq_u16(c, vcgtq_u16(s[2], s[3]));
+        c = vandq_u16(c, vcgtq_u16(s[0], s[3]));
+        c = vandq_u16(c, vcgtq_u16(s[0], s[4]));
+        c = vandq_u16(c, vcgtq_u16(s[0], s[5]));
+        c = vandq_u16(c, vcgtq_u16(s[0], s[6]));
+        c = vandq_u16(c, vcgtq_u16(s[7], s[8]));
+        c = vandq_u16(c, vcgtq_u16(s[9], s[8]));
+        c = vandq_u16(c, vcgtq_u16(s[9], s[6]));
+        mask |= vaddvq_u16(vandq_u16(c, bits)) << j;
+    }
+    return mask;
+}
+#endif
+
+static struct {
+    char* name;
+    preambleKernel fn;
+} preamble_kernels[] = {
+#if defined(__aarch64__)
+    { "neon", preambleNEON },
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2", preambleAVX2 },
+    { "sse2", preambleSSE2 },
+#endif
+    { "scalar", preambleScalar },
+    { NULL, NULL }
+};
+
+/* Return 1 if the CPU we are running on can execute the named kernel. */
+static int preambleKernelSupported(char* name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (!strcmp(name, "avx2"))
+        return __builtin_cpu_supports("avx2");
+    if (!strcmp(name, "sse2"))
+        return __builtin_cpu_supports("sse2");
+#endif
+    MODES_NOTUSED(name);
+    return 1;
+}
+
+/* Check the kernel against the reference implementation on a synthetic
+ * buffer: a few levels spanning the whole 16 bit range, so that all the
+ * relations are exercised, and signed comparisons would fail. Returns 1
+ * if the masks are identical. */
+static int preambleKernelCheck(preambleKernel fn)
+{
+    static const uint16_t level[4] = { 0, 100, 40000, 65000 };
+    uint16_t m[4096 + MODES_PREAMBLE_BATCH + 10];
+    uint32_t seed = 1;
+    int j;
+
+    for (j = 0; j < (int)(sizeof(m) / sizeof(m[0])); j++) {
+        seed = seed * 1103515245 + 12345;
+        m[j] = level[(seed >> 16) & 3];
+    }
+    for (j = 0; j < 4096; j++) {
+        if (fn(m + j) != preambleScalar(m + j))
+            return 0;
+    }
+    return 1;
+}
+
+/* Select the prefilter kernel: the one named by --preamble, or the first
+ * one of the table the CPU supports. */
+void modesInitPreamble(void)
+{
+    int j;
+
+    preamble_kernel = NULL;
+    for (j = 0; preamble_kernels[j].name; j++) {
+        char* name = preamble_kernels[j].name;
+
+        if (Modes.preamble_kernel && strcmp(Modes.preamble_kernel, "auto") && strcmp(Modes.preamble_kernel, name))
+            continue;
+        if (!preambleKernelSupported(name)) {
+            if (Modes.preamble_kernel)
+                fprintf(stderr, "Preamble kernel '%s' not supported by this CPU.\n", name);
+            continue;
+        }
+        if (!preambleKernelCheck(preamble_kernels[j].fn)) {
+            fprintf(stderr, "Preamble kernel '%s' does not match the scalar test, skipped.\n", name);
+            continue;
+        }
+        preamble_kernel = preamble_kernels[j].fn;
+        fprintf(stderr, "Preamble kernel: %s\n", name);
+        break;
+    }
+    if (!preamble_kernel) {
+        if (Modes.preamble_kernel && strcmp(Modes.preamble_kernel, "auto"))
+            fprintf(stderr, "Using the scalar preamble kernel instead of '%s'.\n", Modes.preamble_kernel);
+        preamble_kernel = preambleScalar;
+    }
+}
+
+/* Return the mask of the offsets, among the MODES_PREAMBLE_BATCH starting
+ * at 'm', that pass the first preamble test. */
+uint32_t preambleCandidates(uint16_t* m)
+{
+    return preamble_kernel(m);
+}
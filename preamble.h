@@ -0,0 +1,11 @@
+#ifndef PREAMBLE_H
+#define PREAMBLE_H
+
+#include <stdint.h>
+
+#define MODES_PREAMBLE_BATCH 16 /* Offsets tested by every prefilter call. */
+
+void modesInitPreamble(void);
+uint32_t preambleCandidates(uint16_t*);
+
+#endif //PREAMBLE_H
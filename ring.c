@@ -0,0 +1,217 @@
+#include "ring.h"
+#include "data.h"
+#include "interactive.h"
+
+extern struct Modes Modes;
+
+/* ============================== IQ block ring ============================= */
+
+/* The reader thread and the decoder exchange IQ blocks using a single
+ * producer / single consumer ring. Moving a block in or out of the ring
+ * is just an atomic store of 'head' or 'tail', so the reader never waits
+ * for the decoder: when the ring is full the new block is dropped and
+ * counted instead. The mutex is only taken when one of the two threads
+ * has nothing left to do and goes to sleep. */
+
+/* Allocate 'depth' slots of 'len' bytes each. Slots are filled with the
+ * zero level (127) so that the first overlap area is just silence. When
+ * blocks are only lent to the ring 'len' is zero and no buffer is
+ * allocated. */
+void ringInit(struct iqRing* r, uint32_t depth, uint32_t len)
+{
+    uint32_t overlap = (MODES_FULL_LEN - 1) * 4;
+    uint32_t j;
+
+    r->depth = depth;
+    if ((r->blocks = malloc(sizeof(struct iqBlock) * depth)) == NULL || (r->seam = malloc(overlap)) == NULL) {
+        fprintf(stderr, "Out of memory allocating IQ ring.\n");
+        exit(1);
+    }
+    memset(r->seam, 127, overlap);
+    for (j = 0; j < depth; j++) {
+        struct iqBlock* b = &r->blocks[j];
+
+        if (!len) {
+            b->buf = NULL;
+            continue;
+        }
+        if ((b->buf = malloc(len)) == NULL) {
+            fprintf(stderr, "Out of memory allocating IQ ring.\n");
+            exit(1);
+        }
+        memset(b->buf, 127, len);
+    }
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->waiting, 0);
+    atomic_init(&r->lending, 0);
+    atomic_init(&r->closed, 0);
+    atomic_init(&r->high_water, 0);
+    atomic_init(&r->dropped, 0);
+    r->last = NULL;
+    r->samples = 0;
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    pthread_cond_init(&r->released, NULL);
+}
+
+/* Return the number of slots filled and not yet released. */
+uint32_t ringUsed(struct iqRing* r)
+{
+    uint32_t head = atomic_load(&r->head);
+    uint32_t tail = atomic_load(&r->tail);
+
+    return (head + 2 * r->depth - tail) % (2 * r->depth);
+}
+
+/* Stamp the block with the clock of its first sample, and account for its
+ * 'len' bytes. The block is assumed to be handed out by the device as soon
+ * as its last sample was received. */
+static void ringStamp(struct iqRing* r, struct iqBlock* b, uint32_t len)
+{
+    b->timestamp = r->samples * MODES_CLOCK_PER_SAMPLE;
+    b->ms = mstime() - (long long)len / 2 * 1000 / MODES_DEFAULT_RATE;
+    r->samples += len / 2;
+}
+
+/* Make the slot at 'head' visible to the decoder, and wake it up only if
+ * it is actually sleeping. Both 'head' and 'waiting' use sequentially
+ * consistent accesses, so either we see the decoder waiting, or the
+ * decoder sees the new block before going to sleep. */
+static void ringPublish(struct iqRing* r, uint32_t head, uint32_t used)
+{
+    atomic_store(&r->head, (head + 1) % (2 * r->depth));
+    if (used + 1 > atomic_load_explicit(&r->high_water, memory_order_relaxed))
+        atomic_store_explicit(&r->high_water, used + 1, memory_order_relaxed);
+
+    if (atomic_load(&r->waiting)) {
+        pthread_mutex_lock(&r->mutex);
+        pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&r->mutex);
+    }
+}
+
+/* Copy 'len' bytes of IQ samples into the next free slot. The last part of
+ * the previous block, that the decoder could not process, is moved at the
+ * start of the slot so that messages crossing two reads are detected.
+ * If a block was dropped just before, the two blocks are not contiguous
+ * and the overlap is filled with silence instead.
+ *
+ * Must only be called by the producer. Returns 1 if the block was queued,
+ * 0 if it was dropped because the ring is full. */
+int ringPush(struct iqRing* r, unsigned char* buf, uint32_t len)
+{
+    uint32_t overlap = (MODES_FULL_LEN - 1) * 4;
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t used = ringUsed(r);
+    struct iqBlock* b;
+
+    if (used == r->depth) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        r->samples += len / 2;
+        r->last = NULL;
+        return 0;
+    }
+
+    if (len > MODES_DATA_LEN)
+        len = MODES_DATA_LEN;
+    b = &r->blocks[head % r->depth];
+    ringStamp(r, b, len);
+    b->seam = b->buf;
+    b->data = b->buf + overlap;
+    b->len = len;
+    /* With a single slot the seam is moved within the same buffer. */
+    if (r->last)
+        memmove(b->seam, r->last, overlap);
+    else
+        memset(b->seam, 127, overlap);
+    memcpy(b->data, buf, len);
+    /* The seam is just before the data, so after a short block the next
+     * seam still starts with the end of the previous ones. */
+    r->last = b->data + len - overlap;
+
+    ringPublish(r, head, used);
+    return 1;
+}
+
+/* Zero copy variant of ringPush(): queue the caller's buffer itself, and
+ * wait for the decoder to release it, that is, until its magnitude vector
+ * was computed. Only the seam with the previous block, (MODES_FULL_LEN - 1)
+ * * 4 bytes, is copied, after the buffer is released.
+ *
+ * Since the reader waits for every block, there is never more than one
+ * block in the ring in this mode. Always returns 1. */
+int ringLend(struct iqRing* r, unsigned char* buf, uint32_t len)
+{
+    uint32_t overlap = (MODES_FULL_LEN - 1) * 4;
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    struct iqBlock* b = &r->blocks[head % r->depth];
+
+    if (len > MODES_DATA_LEN)
+        len = MODES_DATA_LEN;
+    ringStamp(r, b, len);
+    b->seam = r->seam;
+    b->data = buf;
+    b->len = len;
+    ringPublish(r, head, ringUsed(r));
+
+    pthread_mutex_lock(&r->mutex);
+    atomic_store(&r->lending, 1);
+    while (ringUsed(r))
+        pthread_cond_wait(&r->released, &r->mutex);
+    atomic_store(&r->lending, 0);
+    pthread_mutex_unlock(&r->mutex);
+
+    /* A short block only replaces the end of the seam: the samples before
+     * it still come from the previous blocks. */
+    if (len >= overlap) {
+        memcpy(r->seam, buf + len - overlap, overlap);
+    } else {
+        memmove(r->seam, r->seam + len, overlap - len);
+        memcpy(r->seam + overlap - len, buf, len);
+    }
+    return 1;
+}
+
+/* Return the oldest filled slot, waiting for the reader if the ring is
+ * empty. The slot stays owned by the decoder until ringRelease() is
+ * called. Returns NULL once the ring was closed and every block consumed.
+ * Must only be called by the consumer. */
+struct iqBlock* ringPop(struct iqRing* r)
+{
+    if (!ringUsed(r)) {
+        pthread_mutex_lock(&r->mutex);
+        atomic_store(&r->waiting, 1);
+        while (!ringUsed(r) && !atomic_load(&r->closed))
+            pthread_cond_wait(&r->cond, &r->mutex);
+        atomic_store(&r->waiting, 0);
+        pthread_mutex_unlock(&r->mutex);
+        if (!ringUsed(r))
+            return NULL;
+    }
+    return &r->blocks[atomic_load(&r->tail) % r->depth];
+}
+
+/* Give back to the reader the slot returned by ringPop(). In zero copy mode
+ * this also hands the buffer back to librtlsdr. */
+void ringRelease(struct iqRing* r)
+{
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    atomic_store(&r->tail, (tail + 1) % (2 * r->depth));
+    if (atomic_load(&r->lending)) {
+        pthread_mutex_lock(&r->mutex);
+        pthread_cond_signal(&r->released);
+        pthread_mutex_unlock(&r->mutex);
+    }
+}
+
+/* Called by the producer when there is no more data to read, so that the
+ * decoder stops once the ring is drained. */
+void ringClose(struct iqRing* r)
+{
+    pthread_mutex_lock(&r->mutex);
+    atomic_store(&r->closed, 1);
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+}
@@ -0,0 +1,14 @@
+#ifndef RING_H
+#define RING_H
+
+#include "data.h"
+
+void ringInit(struct iqRing*, uint32_t, uint32_t);
+int ringPush(struct iqRing*, unsigned char*, uint32_t);
+int ringLend(struct iqRing*, unsigned char*, uint32_t);
+struct iqBlock* ringPop(struct iqRing*);
+void ringRelease(struct iqRing*);
+void ringClose(struct iqRing*);
+uint32_t ringUsed(struct iqRing*);
+
+#endif //RING_H
@@ -0,0 +1,182 @@
+#include "rtltcp.h"
+#include "data.h"
+#include "ring.h"
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+extern struct Modes Modes;
+
+/* ============================== rtl_tcp input ============================= */
+
+/* An rtl_tcp server streams the raw 8 bit unsigned I/Q samples of a remote
+ * device, after a 12 byte header: "RTL0", the tuner type and the number
+ * of gains, both 32 bit big endian. The device is configured with 5 byte
+ * commands: a command byte and a 32 bit big endian parameter. */
+#define RTLTCP_SET_FREQ 0x01
+#define RTLTCP_SET_SAMPLE_RATE 0x02
+#define RTLTCP_SET_GAIN_MODE 0x03
+#define RTLTCP_SET_FREQ_CORRECTION 0x05
+#define RTLTCP_SET_GAIN_BY_INDEX 0x0d
+
+/* Send a command to the server. */
+static void rtltcpCommand(int cmd, uint32_t param)
+{
+    unsigned char buf[5];
+
+    buf[0] = cmd;
+    buf[1] = param >> 24;
+    buf[2] = param >> 16;
+    buf[3] = param >> 8;
+    buf[4] = param;
+    if (send(Modes.rtltcp_fd, buf, sizeof(buf), MSG_NOSIGNAL) != sizeof(buf)) {
+        fprintf(stderr, "Error sending a command to the rtl_tcp server: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+/* Connect to the server given with --rtl-tcp as host[:port], read its
+ * header and configure the device like modesInitRTLSDR() does. An IPv6
+ * address is given in brackets to add a port, as in [::1]:1234. */
+void modesInitRtlTcp(void)
+{
+    struct addrinfo hints, *res, *ai;
+    unsigned char header[12];
+    char buf[256];
+    char* host = buf;
+    const char* port = MODES_RTLTCP_PORT;
+    char* colon;
+    uint32_t gains;
+    size_t got = 0;
+    int rcvbuf = MODES_RTLTCP_RCVBUF_SIZE;
+    int err;
+
+    snprintf(buf, sizeof(buf), "%s", Modes.rtltcp);
+    if (buf[0] == '[' && (colon = strchr(buf, ']')) != NULL) {
+        /* [address] or [address]:port */
+        *colon = '\0';
+        host = buf + 1;
+        if (colon[1] == ':')
+            port = colon + 2;
+    } else {
+        /* More than one ':' is a bare IPv6 address without port. */
+        colon = strrchr(buf, ':');
+        if (colon && colon == strchr(buf, ':')) {
+            *colon = '\0';
+            port = colon + 1;
+        }
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(host, port, &hints, &res)) != 0) {
+        fprintf(stderr, "Error resolving the rtl_tcp server '%s': %s\n", Modes.rtltcp, gai_strerror(err));
+        exit(1);
+    }
+    Modes.rtltcp_fd = -1;
+    for (ai = res; ai && Modes.rtltcp_fd == -1; ai = ai->ai_next) {
+        Modes.rtltcp_fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (Modes.rtltcp_fd == -1)
+            continue;
+        /* Set before connecting, so that the TCP window scales to it. */
+        setsockopt(Modes.rtltcp_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        if (connect(Modes.rtltcp_fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+            close(Modes.rtltcp_fd);
+            Modes.rtltcp_fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (Modes.rtltcp_fd == -1) {
+        fprintf(stderr, "Error connecting to the rtl_tcp server '%s': %s\n", Modes.rtltcp, strerror(errno));
+        exit(1);
+    }
+
+    while (got < sizeof(header)) {
+        ssize_t n = recv(Modes.rtltcp_fd, header + got, sizeof(header) - got, 0);
+
+        if (n <= 0 && !(n == -1 && errno == EINTR)) {
+            fprintf(stderr, "Error reading the rtl_tcp header: %s\n", n ? strerror(errno) : "connection closed");
+            exit(1);
+        }
+        if (n > 0)
+            got += n;
+    }
+    if (memcmp(header, "RTL0", 4)) {
+        fprintf(stderr, "'%s' is not an rtl_tcp server.\n", Modes.rtltcp);
+        exit(1);
+    }
+    gains = header[8] << 24 | header[9] << 16 | header[10] << 8 | header[11];
+
+    /* Set gain, frequency and sample rate. The max gain is the last one. */
+    if (gains) {
+        rtltcpCommand(RTLTCP_SET_GAIN_MODE, 1);
+        rtltcpCommand(RTLTCP_SET_GAIN_BY_INDEX, gains - 1);
+    } else {
+        rtltcpCommand(RTLTCP_SET_GAIN_MODE, 0);
+    }
+    rtltcpCommand(RTLTCP_SET_FREQ_CORRECTION, 0);
+    rtltcpCommand(RTLTCP_SET_FREQ, MODES_DEFAULT_FREQ);
+    rtltcpCommand(RTLTCP_SET_SAMPLE_RATE, MODES_DEFAULT_RATE);
+    fcntl(Modes.rtltcp_fd, F_SETFL, fcntl(Modes.rtltcp_fd, F_GETFL) | O_NONBLOCK);
+    fprintf(stderr, "Connected to rtl_tcp server '%s': tuner type %u, %u gains.\n", Modes.rtltcp,
+        header[4] << 24 | header[5] << 16 | header[6] << 8 | header[7], gains);
+}
+
+/* Receive the samples in blocks of MODES_DATA_LEN bytes, queued in the IQ
+ * ring like the librtlsdr callback does. Every recv() asks for the whole
+ * free part of the block, so that a busy stream is received with few
+ * large reads; the socket is non blocking and we only wait in poll()
+ * when the kernel has nothing for us. As the blocks are full, I/Q pairs
+ * are never split between two blocks. */
+void* rtltcpReaderThreadEntryPoint(void* arg)
+{
+    unsigned char* buf = malloc(MODES_DATA_LEN);
+    struct pollfd pfd;
+    uint32_t len = 0;
+
+    MODES_NOTUSED(arg);
+
+    if (!buf) {
+        fprintf(stderr, "Out of memory allocating the rtl_tcp buffer.\n");
+        exit(1);
+    }
+    pfd.fd = Modes.rtltcp_fd;
+    pfd.events = POLLIN;
+    while (!Modes.exit) {
+        ssize_t n = recv(Modes.rtltcp_fd, buf + len, MODES_DATA_LEN - len, 0);
+
+        if (n > 0) {
+            Modes.stat_rtltcp_reads++;
+            len += n;
+            if (len < MODES_DATA_LEN)
+                continue;
+            if (Modes.zero_copy)
+                ringLend(&Modes.ring, buf, len);
+            else
+                ringPush(&Modes.ring, buf, len);
+            len = 0;
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            poll(&pfd, 1, MODES_INTERACTIVE_REFRESH_TIME);
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            fprintf(stderr, "Error reading from the rtl_tcp server: %s\n", strerror(errno));
+        else
+            fprintf(stderr, "The rtl_tcp server closed the connection.\n");
+        break;
+    }
+    /* Decode what was received before the connection was closed. */
+    if (len) {
+        if (Modes.zero_copy)
+            ringLend(&Modes.ring, buf, len & ~1U);
+        else
+            ringPush(&Modes.ring, buf, len & ~1U);
+    }
+    ringClose(&Modes.ring);
+    free(buf);
+    return NULL;
+}
@@ -0,0 +1,7 @@
+#ifndef RTLTCP_H
+#define RTLTCP_H
+
+void* rtltcpReaderThreadEntryPoint(void*);
+void modesInitRtlTcp(void);
+
+#endif //RTLTCP_H
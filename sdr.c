@@ -1,69 +1,132 @@
 #include "sdr.h"
 #include "data.h"
+#include "ring.h"
 
 extern struct Modes Modes;
 
 /* =============================== RTLSDR handling ========================== */
 
+/* Return the librtlsdr index of the device named 'name' on the command
+ * line: either an index, or a serial number. */
+static int rtlsdrFindDevice(const char* name)
+{
+    const char* p = name;
+    int index;
+
+    while (isdigit((unsigned char)*p))
+        p++;
+    if (*name && !*p)
+        return atoi(name);
+    if ((index = rtlsdr_get_index_by_serial(name)) < 0) {
+        fprintf(stderr, "No RTLSDR device with serial '%s'.\n", name);
+        exit(1);
+    }
+    return index;
+}
+
+/* Open and configure every device given with --device, device 0 by
+ * default. The first device uses Modes.ring and Modes.magnitude, the other
+ * ones get their own. */
 void modesInitRTLSDR(void)
 {
+    int j, k;
+
     if (!rtlsdr_get_device_count()) {
         fprintf(stderr, "No supported RTLSDR devices found.\n");
         exit(1);
     }
-
-    if (rtlsdr_open(&Modes.dev, 0) < 0) {
-        fprintf(stderr, "Error opening the RTLSDR device: %s\n",
-            strerror(errno));
+    if ((Modes.devices = calloc(Modes.ndevices, sizeof(struct sdrDevice))) == NULL) {
+        fprintf(stderr, "Out of memory allocating the devices.\n");
         exit(1);
     }
+    pthread_mutex_init(&Modes.tracker_mutex, NULL);
+
+    for (j = 0; j < Modes.ndevices; j++) {
+        struct sdrDevice* d = &Modes.devices[j];
+        char vendor[256], product[256], serial[256];
+        int numgains;
+        int gains[100];
+
+        d->index = rtlsdrFindDevice(Modes.device_names[j]);
+        for (k = 0; k < j; k++) {
+            if (Modes.devices[k].index == d->index) {
+                fprintf(stderr, "RTLSDR device '%s' given twice.\n", Modes.device_names[j]);
+                exit(1);
+            }
+        }
+        if (rtlsdr_open(&d->dev, d->index) < 0) {
+            fprintf(stderr, "Error opening the RTLSDR device '%s': %s\n",
+                Modes.device_names[j], strerror(errno));
+            exit(1);
+        }
+
+        /* Set gain, frequency, sample rate, and reset the device. */
+        rtlsdr_set_tuner_gain_mode(d->dev, 1);
+        numgains = rtlsdr_get_tuner_gains(d->dev, gains);
+        rtlsdr_set_tuner_gain(d->dev, gains[numgains - 1]);
+        rtlsdr_set_freq_correction(d->dev, 0);
+        rtlsdr_set_center_freq(d->dev, MODES_DEFAULT_FREQ);
+        rtlsdr_set_sample_rate(d->dev, MODES_DEFAULT_RATE);
+        rtlsdr_reset_buffer(d->dev);
+        if (rtlsdr_get_device_usb_strings(d->index, vendor, product, serial) < 0)
+            serial[0] = '\0';
+        fprintf(stderr, "Device %d: index %d, serial '%s', gain reported by device: %.2f\n",
+            j, d->index, serial, rtlsdr_get_tuner_gain(d->dev) / 10.0);
+
+        if (j == 0) {
+            d->ring = &Modes.ring;
+            d->magnitude = Modes.magnitude;
+            continue;
+        }
+        if ((d->ring = malloc(sizeof(struct iqRing))) == NULL
+            || (d->magnitude = malloc(Modes.data_len * 2)) == NULL) {
+            fprintf(stderr, "Out of memory allocating the buffers of device %d.\n", j);
+            exit(1);
+        }
+        ringInit(d->ring, Modes.ring_depth, Modes.zero_copy ? 0 : Modes.data_len);
+    }
+}
 
-    /* Set gain, frequency, sample rate, and reset the device. */
-    rtlsdr_set_tuner_gain_mode(Modes.dev, 1);
-    int numgains;
-    int gains[100];
-    numgains = rtlsdr_get_tuner_gains(Modes.dev, gains);
-    rtlsdr_set_tuner_gain(Modes.dev, gains[numgains - 1]);
-    rtlsdr_set_freq_correction(Modes.dev, 0);
-    rtlsdr_set_center_freq(Modes.dev, MODES_DEFAULT_FREQ);
-    rtlsdr_set_sample_rate(Modes.dev, MODES_DEFAULT_RATE);
-    rtlsdr_reset_buffer(Modes.dev);
-    fprintf(stderr, "Gain reported by device: %.2f\n",
-        rtlsdr_get_tuner_gain(Modes.dev) / 10.0);
+/* Close every device. */
+void modesCloseRTLSDR(void)
+{
+    int j;
+
+    for (j = 0; j < Modes.ndevices; j++)
+        rtlsdr_close(Modes.devices[j].dev);
 }
 
-/* We use a thread reading data in background, while the main thread
- * handles decoding and visualization of data to the user.
+/* We use a thread per device reading data in background, while the main
+ * thread handles decoding and visualization of data to the user.
  *
  * The reading thread calls the RTLSDR API to read data asynchronously, and
- * uses a callback to populate the data buffer.
- * A Mutex is used to avoid races with the decoding thread. */
+ * uses a callback to queue every block in the IQ ring of the device. If the
+ * decoder is too slow and the ring is full the block is dropped, the
+ * reader never waits for the decoder.
+ *
+ * In zero copy mode the librtlsdr buffer itself is queued, and the
+ * callback only returns once the decoder computed its magnitude vector,
+ * as librtlsdr reuses the buffer as soon as we return. The other async
+ * buffers keep receiving data from the device meanwhile. */
 void rtlsdrCallback(unsigned char* buf, uint32_t len, void* ctx)
 {
-    MODES_NOTUSED(ctx);
-
-    pthread_mutex_lock(&Modes.data_mutex);
-    if (len > MODES_DATA_LEN)
-        len = MODES_DATA_LEN;
-    /* Move the last part of the previous buffer, that was not processed,
-     * on the start of the new buffer. */
-    memcpy(Modes.data, Modes.data + MODES_DATA_LEN, (MODES_FULL_LEN - 1) * 4);
-    /* Read the new data. */
-    memcpy(Modes.data + (MODES_FULL_LEN - 1) * 4, buf, len);
-    Modes.data_ready = 1;
-    /* Signal to the other thread that new data is ready */
-    pthread_cond_signal(&Modes.data_cond);
-    pthread_mutex_unlock(&Modes.data_mutex);
+    struct sdrDevice* d = ctx;
+
+    if (Modes.zero_copy)
+        ringLend(d->ring, buf, len);
+    else
+        ringPush(d->ring, buf, len);
 }
 
 /* We read data using a thread, so the main thread only handles decoding
- * without caring about data acquisition. */
+ * without caring about data acquisition. 'arg' is the device. */
 void* readerThreadEntryPoint(void* arg)
 {
-    MODES_NOTUSED(arg);
+    struct sdrDevice* d = arg;
 
-    rtlsdr_read_async(Modes.dev, rtlsdrCallback, NULL,
+    rtlsdr_read_async(d->dev, rtlsdrCallback, d,
         MODES_ASYNC_BUF_NUMBER,
         MODES_DATA_LEN);
+    ringClose(d->ring);
     return NULL;
 }
@@ -3,5 +3,6 @@
 
 void* readerThreadEntryPoint(void*);
 void modesInitRTLSDR(void);
+void modesCloseRTLSDR(void);
 
-#endif //SDR_H
\ No newline at end of file
+#endif //SDR_H